@@ -0,0 +1,61 @@
+#include "arena.h"
+#include "bigalloc.h"
+
+#define ARENA_ALIGN 16
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t len;
+} __attribute__((aligned(ARENA_ALIGN)));
+
+void arena_init(struct arena *arena)
+{
+	arena->chunks = NULL;
+	arena->next = arena->end = NULL;
+	arena->chunk_size = ARENA_CHUNK;
+}
+
+static struct arena_chunk *new_chunk(struct arena *arena, size_t size)
+{
+	size_t len = sizeof(struct arena_chunk) + size;
+	/* Nodes get followed back all over the place. */
+	struct arena_chunk *c = big_alloc(1, len, BIG_NORMAL);
+
+	c->len = len;
+	c->next = arena->chunks;
+	arena->chunks = c;
+	return c;
+}
+
+void *arena_alloc(struct arena *arena, size_t size)
+{
+	struct arena_chunk *c;
+	void *p;
+
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	if (size > arena->end - arena->next) {
+		/* Don't throw away the rest of this chunk for a big one. */
+		if (size > arena->chunk_size / 4)
+			return new_chunk(arena, size) + 1;
+		/* Header and all, so the mapping is a power of two. */
+		c = new_chunk(arena, arena->chunk_size - sizeof(*c));
+		arena->next = (char *)(c + 1);
+		arena->end = (char *)c + arena->chunk_size;
+		if (arena->chunk_size < ARENA_CHUNK_MAX)
+			arena->chunk_size *= 2;
+	}
+	p = arena->next;
+	arena->next += size;
+	return p;
+}
+
+void arena_free(struct arena *arena)
+{
+	while (arena->chunks) {
+		struct arena_chunk *c = arena->chunks;
+
+		arena->chunks = c->next;
+		big_free(c, 1, c->len);
+	}
+	arena_init(arena);
+}
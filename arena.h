@@ -0,0 +1,38 @@
+#ifndef ARENA_H
+#define ARENA_H
+#include <stdlib.h>
+
+/* Region allocator for a run's per-block storage: allocations are
+ * carved out of big chunks (from big_alloc, so they honour
+ * --backing-file and --huge-pages), and all released at once by
+ * arena_free(), so a long-lived process running many chains doesn't
+ * grow.
+ *
+ * Chunks start at ARENA_CHUNK and double up to ARENA_CHUNK_MAX, so a
+ * huge run takes a few hundred mappings (not one per MB, which runs
+ * into vm.max_map_count), and they're soon big enough for huge pages. */
+#ifndef ARENA_CHUNK
+#define ARENA_CHUNK ((size_t)1 << 20)
+#endif
+#ifndef ARENA_CHUNK_MAX
+#define ARENA_CHUNK_MAX ((size_t)256 << 20)
+#endif
+
+struct arena_chunk;
+
+struct arena {
+	struct arena_chunk *chunks;
+	char *next, *end;
+	/* Size of the next chunk, header included. */
+	size_t chunk_size;
+};
+
+void arena_init(struct arena *arena);
+
+/* Zeroed, 16-byte aligned; exits on failure.  Big allocations get a
+ * chunk to themselves. */
+void *arena_alloc(struct arena *arena, size_t size);
+
+/* Release everything arena_alloc() returned; arena is then empty. */
+void arena_free(struct arena *arena);
+#endif /* ARENA_H */
@@ -0,0 +1,153 @@
+/* Check the closed-form proof lengths in prooflen.h against the
+ * original recursive/looping versions, and time both. */
+#include <ccan/ilog/ilog.h>
+#include <ccan/err/err.h>
+#include <stdio.h>
+#include <assert.h>
+#include <stdbool.h>
+#include <time.h>
+#include "prooflen.h"
+
+/* The originals, as they were in test-trees.c. */
+static size_t do_proof_len(size_t to, size_t start, size_t end)
+{
+	size_t len;
+
+	/* Reached the node? */
+	if (end - start == 1) {
+		assert(to == start);
+		return 0;
+	}
+
+	len = (1 << (ilog32(end - start - 1) - 1));
+	if (to < start + len)
+		return 1 + do_proof_len(to, start, start + len);
+	return 1 + do_proof_len(to, start + len, end);
+}
+
+static size_t old_mmr_proof_len(size_t from, size_t to, bool linear)
+{
+	size_t mtns = __builtin_popcount(from), off = 0, peaknum = 0;
+	int i;
+
+	for (i = sizeof(size_t) * CHAR_BIT - 1; i >= 0; i--) {
+		size_t summit = (size_t)1 << i;
+		if (from & summit) {
+			off += summit;
+			if (to < off)
+				break;
+			peaknum++;
+		}
+	}
+
+	if (linear) {
+		if (peaknum == 0)
+			return mtns - peaknum - 1 + i;
+		else
+			return mtns - peaknum + i;
+	} else
+		return do_proof_len(peaknum, 0, mtns) + i;
+}
+
+static size_t new_mmr_proof_len(size_t from, size_t to, bool linear)
+{
+	size_t mtns, peaknum, i;
+
+	i = mmr_mountain(from, to, &peaknum, &mtns);
+	if (linear) {
+		if (peaknum == 0)
+			return mtns - peaknum - 1 + i;
+		else
+			return mtns - peaknum + i;
+	} else
+		return rfc6962_depth(peaknum, mtns) + i;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+/* Same (from, to) pairs the DP sees: every to in a window below from. */
+#define WINDOW 64
+
+static size_t time_rfc6962(size_t num, bool old, double *secs)
+{
+	size_t from, to, sum = 0;
+	double start = now();
+
+	for (from = 1; from < num; from++) {
+		for (to = from > WINDOW ? from - WINDOW : 0; to < from; to++) {
+			if (old)
+				sum += do_proof_len(to, 0, from);
+			else
+				sum += rfc6962_depth(to, from);
+		}
+	}
+	*secs = now() - start;
+	return sum;
+}
+
+static size_t time_mmr(size_t num, bool old, bool linear, double *secs)
+{
+	size_t from, to, sum = 0;
+	double start = now();
+
+	for (from = 1; from < num; from++) {
+		for (to = from > WINDOW ? from - WINDOW : 0; to < from; to++) {
+			if (old)
+				sum += old_mmr_proof_len(from, to, linear);
+			else
+				sum += new_mmr_proof_len(from, to, linear);
+		}
+	}
+	*secs = now() - start;
+	return sum;
+}
+
+int main(int argc, char *argv[])
+{
+	size_t num = argc > 1 ? atol(argv[1]) : 1000000, from, to;
+	size_t oldsum, newsum;
+	double oldsecs, newsecs;
+
+	/* Exhaustive check on small trees. */
+	for (from = 1; from < 4096; from++) {
+		for (to = 0; to < from; to++) {
+			if (do_proof_len(to, 0, from) != rfc6962_depth(to, from))
+				errx(1, "rfc6962 %zu/%zu mismatch", to, from);
+			if (old_mmr_proof_len(from, to, false)
+			    != new_mmr_proof_len(from, to, false))
+				errx(1, "mmr %zu/%zu mismatch", to, from);
+			if (old_mmr_proof_len(from, to, true)
+			    != new_mmr_proof_len(from, to, true))
+				errx(1, "mmr-linear %zu/%zu mismatch", to, from);
+		}
+	}
+
+	oldsum = time_rfc6962(num, true, &oldsecs);
+	newsum = time_rfc6962(num, false, &newsecs);
+	if (oldsum != newsum)
+		errx(1, "rfc6962 sums differ: %zu vs %zu", oldsum, newsum);
+	printf("rfc6962: old %.3fs, new %.3fs (%.1fx)\n",
+	       oldsecs, newsecs, oldsecs / newsecs);
+
+	oldsum = time_mmr(num, true, false, &oldsecs);
+	newsum = time_mmr(num, false, false, &newsecs);
+	if (oldsum != newsum)
+		errx(1, "mmr sums differ: %zu vs %zu", oldsum, newsum);
+	printf("mmr: old %.3fs, new %.3fs (%.1fx)\n",
+	       oldsecs, newsecs, oldsecs / newsecs);
+
+	oldsum = time_mmr(num, true, true, &oldsecs);
+	newsum = time_mmr(num, false, true, &newsecs);
+	if (oldsum != newsum)
+		errx(1, "mmr-linear sums differ: %zu vs %zu", oldsum, newsum);
+	printf("mmr-linear: old %.3fs, new %.3fs (%.1fx)\n",
+	       oldsecs, newsecs, oldsecs / newsecs);
+
+	return 0;
+}
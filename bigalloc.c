@@ -0,0 +1,88 @@
+#include <ccan/err/err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "bigalloc.h"
+
+static const char *backing_dir;
+static bool huge_pages;
+
+void bigalloc_setup(const char *dir, bool huge)
+{
+	/* Transparent huge pages don't do shared file mappings. */
+	if (dir && huge)
+		errx(1, "--huge-pages doesn't work with --backing-file");
+	backing_dir = dir;
+	huge_pages = huge;
+}
+
+static bool use_mmap(void)
+{
+	return backing_dir || huge_pages;
+}
+
+void *big_alloc(size_t num, size_t size, enum big_access access)
+{
+	size_t len = num * size;
+	void *p;
+
+	if (!len)
+		len = 1;
+
+	if (!use_mmap()) {
+		if (posix_memalign(&p, 64, len) != 0)
+			errx(1, "Allocating %zu bytes", len);
+		memset(p, 0, len);
+		return p;
+	}
+
+	if (backing_dir) {
+		char file[strlen(backing_dir) + sizeof("/bigalloc-XXXXXX")];
+		int fd;
+
+		sprintf(file, "%s/bigalloc-XXXXXX", backing_dir);
+		fd = mkstemp(file);
+		if (fd < 0)
+			err(1, "Creating backing file in %s", backing_dir);
+		/* Nobody else needs to see it: goes away when unmapped. */
+		unlink(file);
+		/* Take the disk now: with a sparse file, running out of
+		 * space would be a SIGBUS halfway through the run. */
+		errno = posix_fallocate(fd, 0, len);
+		if (errno)
+			err(1, "Allocating %zu bytes for backing file", len);
+		p = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+	} else
+		p = mmap(NULL, len, PROT_READ|PROT_WRITE,
+			 MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+
+	if (p == MAP_FAILED)
+		err(1, "Mapping %zu bytes", len);
+
+	if (access == BIG_SEQUENTIAL)
+		madvise(p, len, MADV_SEQUENTIAL);
+	else if (access == BIG_RANDOM)
+		madvise(p, len, MADV_RANDOM);
+#ifdef MADV_HUGEPAGE
+	if (huge_pages)
+		madvise(p, len, MADV_HUGEPAGE);
+#endif
+	return p;
+}
+
+void big_free(void *p, size_t num, size_t size)
+{
+	size_t len = num * size;
+
+	if (!len)
+		len = 1;
+
+	if (!use_mmap())
+		free(p);
+	else
+		munmap(p, len);
+}
@@ -0,0 +1,29 @@
+#ifndef BIGALLOC_H
+#define BIGALLOC_H
+#include <stdlib.h>
+#include <stdbool.h>
+
+/* Allocator for the big per-block arrays.  By default they're just
+ * zeroed heap memory, but with a backing directory each one is an
+ * already-unlinked file there, mmap'd in, so a run can be larger than
+ * RAM and page through a scratch disk instead.  The disk is reserved
+ * up front, so running out of it is an error, not a SIGBUS later.  Huge pages
+ * are only for anonymous memory: asking for both is an error.
+ *
+ * Call bigalloc_setup() (from option parsing) before any big_alloc(). */
+void bigalloc_setup(const char *backing_dir, bool huge_pages);
+
+/* How an array is used, for paging it in when it's mmap'd. */
+enum big_access {
+	/* Filled in block order, and mostly looked back a little into. */
+	BIG_SEQUENTIAL,
+	/* Jumped about in, like a tree laid out in an array. */
+	BIG_RANDOM,
+	/* Neither in particular. */
+	BIG_NORMAL,
+};
+
+/* Zeroed, 64-byte aligned; exits on failure. */
+void *big_alloc(size_t num, size_t size, enum big_access access);
+void big_free(void *p, size_t num, size_t size);
+#endif /* BIGALLOC_H */
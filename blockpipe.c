@@ -0,0 +1,162 @@
+#include <ccan/err/err.h>
+#include <assert.h>
+#include <inttypes.h>
+#include "blockpipe.h"
+
+/* Draw up to a batch into the ring; returns how many. */
+static size_t blockpipe_fill(struct blockpipe *pipe)
+{
+	uint64_t head = atomic_load_explicit(&pipe->head, memory_order_relaxed);
+	uint64_t tail = atomic_load_explicit(&pipe->tail, memory_order_acquire);
+	uint64_t limit = atomic_load_explicit(&pipe->limit,
+					      memory_order_acquire);
+	size_t idx = head % BLOCKPIPE_SIZE, n, k;
+	uint64_t hash[BLOCKPIPE_BATCH];
+
+	/* Free, contiguous, below limit, and a batch at most. */
+	n = BLOCKPIPE_SIZE - (head - tail);
+	if (n > BLOCKPIPE_SIZE - idx)
+		n = BLOCKPIPE_SIZE - idx;
+	if (n > BLOCKPIPE_BATCH)
+		n = BLOCKPIPE_BATCH;
+	if (n > limit - head)
+		n = limit - head;
+	if (!n)
+		return 0;
+
+	blockrng_fill(&pipe->rng, hash, n);
+	for (k = 0; k < n; k++) {
+		pipe->ring[idx + k].hash = hash[k];
+		pipe->ring[idx + k].skip = -1ULL / hash[k];
+	}
+	atomic_store_explicit(&pipe->head, head + n, memory_order_release);
+	return n;
+}
+
+/* Wake the other side if it's (about to be) asleep on cond.  The
+ * fence orders our update before reading their flag; they set the flag
+ * before rechecking, so one of us sees the other. */
+static void blockpipe_wake(struct blockpipe *pipe, atomic_bool *waiting,
+			   pthread_cond_t *cond)
+{
+	atomic_thread_fence(memory_order_seq_cst);
+	if (!atomic_load_explicit(waiting, memory_order_relaxed))
+		return;
+	pthread_mutex_lock(&pipe->lock);
+	pthread_cond_signal(cond);
+	pthread_mutex_unlock(&pipe->lock);
+}
+
+static bool blockpipe_can_fill(struct blockpipe *pipe)
+{
+	uint64_t head = atomic_load(&pipe->head);
+
+	return atomic_load(&pipe->stop)
+		|| (head - atomic_load(&pipe->tail) < BLOCKPIPE_SIZE
+		    && head < atomic_load(&pipe->limit));
+}
+
+static void *blockpipe_producer(void *arg)
+{
+	struct blockpipe *pipe = arg;
+
+	while (!atomic_load_explicit(&pipe->stop, memory_order_acquire)) {
+		if (blockpipe_fill(pipe)) {
+			blockpipe_wake(pipe, &pipe->consumer_waiting,
+				       &pipe->consumer_cond);
+			continue;
+		}
+		/* Full, or at limit: sleep until that changes. */
+		pthread_mutex_lock(&pipe->lock);
+		atomic_store(&pipe->producer_waiting, true);
+		if (!blockpipe_can_fill(pipe))
+			pthread_cond_wait(&pipe->producer_cond, &pipe->lock);
+		atomic_store(&pipe->producer_waiting, false);
+		pthread_mutex_unlock(&pipe->lock);
+	}
+	return NULL;
+}
+
+void blockpipe_start(struct blockpipe *pipe, const struct blockrng *rng,
+		     uint64_t limit, bool threaded)
+{
+	pipe->rng = *rng;
+	atomic_init(&pipe->head, rng->next);
+	atomic_init(&pipe->tail, rng->next);
+	atomic_init(&pipe->limit, limit);
+	atomic_init(&pipe->stop, false);
+	atomic_init(&pipe->producer_waiting, false);
+	atomic_init(&pipe->consumer_waiting, false);
+	pipe->threaded = threaded;
+	if (!threaded)
+		return;
+	pthread_mutex_init(&pipe->lock, NULL);
+	pthread_cond_init(&pipe->producer_cond, NULL);
+	pthread_cond_init(&pipe->consumer_cond, NULL);
+	if (pthread_create(&pipe->thread, NULL, blockpipe_producer, pipe))
+		err(1, "Creating producer thread");
+}
+
+/* Wait until the producer has drawn up to 'upto'. */
+static void blockpipe_wait(struct blockpipe *pipe, uint64_t upto)
+{
+	while (atomic_load_explicit(&pipe->head, memory_order_acquire) < upto) {
+		if (!pipe->threaded) {
+			if (!blockpipe_fill(pipe))
+				errx(1, "blockpipe: block %"PRIu64" past limit",
+				     upto - 1);
+			continue;
+		}
+		pthread_mutex_lock(&pipe->lock);
+		atomic_store(&pipe->consumer_waiting, true);
+		if (atomic_load(&pipe->head) < upto)
+			pthread_cond_wait(&pipe->consumer_cond, &pipe->lock);
+		atomic_store(&pipe->consumer_waiting, false);
+		pthread_mutex_unlock(&pipe->lock);
+	}
+}
+
+struct block_draw blockpipe_next(struct blockpipe *pipe)
+{
+	uint64_t tail = atomic_load_explicit(&pipe->tail, memory_order_relaxed);
+	struct block_draw d;
+
+	blockpipe_wait(pipe, tail + 1);
+	d = pipe->ring[tail % BLOCKPIPE_SIZE];
+	atomic_store_explicit(&pipe->tail, tail + 1, memory_order_release);
+	/* A batch's worth of room: worth waking the producer for. */
+	if (pipe->threaded && (tail + 1) % BLOCKPIPE_BATCH == 0)
+		blockpipe_wake(pipe, &pipe->producer_waiting,
+			       &pipe->producer_cond);
+	return d;
+}
+
+void blockpipe_rng(struct blockpipe *pipe, struct blockrng *rng)
+{
+	uint64_t limit = atomic_load_explicit(&pipe->limit,
+					      memory_order_relaxed);
+
+	assert(atomic_load(&pipe->tail) == limit);
+	blockpipe_wait(pipe, limit);
+	*rng = pipe->rng;
+}
+
+void blockpipe_limit(struct blockpipe *pipe, uint64_t limit)
+{
+	atomic_store_explicit(&pipe->limit, limit, memory_order_release);
+	if (pipe->threaded)
+		blockpipe_wake(pipe, &pipe->producer_waiting,
+			       &pipe->producer_cond);
+}
+
+void blockpipe_stop(struct blockpipe *pipe)
+{
+	if (!pipe->threaded)
+		return;
+	atomic_store_explicit(&pipe->stop, true, memory_order_release);
+	blockpipe_wake(pipe, &pipe->producer_waiting, &pipe->producer_cond);
+	pthread_join(pipe->thread, NULL);
+	pthread_cond_destroy(&pipe->producer_cond);
+	pthread_cond_destroy(&pipe->consumer_cond);
+	pthread_mutex_destroy(&pipe->lock);
+}
@@ -0,0 +1,54 @@
+#ifndef BLOCKPIPE_H
+#define BLOCKPIPE_H
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "blockrng.h"
+
+/* Each block's hash, and how far back it can skip (unclamped). */
+struct block_draw {
+	uint64_t hash, skip;
+};
+
+/* Draws blocks from a blockrng ahead of the DP.  Threaded, a producer
+ * keeps a single-producer single-consumer ring topped up so the RNG
+ * and the divisions overlap with the DP; otherwise the consumer refills
+ * it itself a batch at a time.  Never draws block 'limit' or beyond,
+ * so callers can stop the rng exactly where they need to save it.
+ *
+ * Either side sleeps on a condition variable when it can't go on (the
+ * producer when the ring is full or at limit), and the other wakes it:
+ * the consumer only every BLOCKPIPE_BATCH blocks, so the producer
+ * refills a batch at a time. */
+#define BLOCKPIPE_SIZE 4096
+#define BLOCKPIPE_BATCH 256
+
+struct blockpipe {
+	struct block_draw ring[BLOCKPIPE_SIZE];
+	/* Next block to draw (producer's) and to hand out (consumer's). */
+	_Atomic uint64_t head, tail;
+	_Atomic uint64_t limit;
+	atomic_bool stop;
+	bool threaded;
+	pthread_t thread;
+	/* For sleeping when threaded: each side says when it's waiting. */
+	pthread_mutex_t lock;
+	pthread_cond_t producer_cond, consumer_cond;
+	atomic_bool producer_waiting, consumer_waiting;
+	/* The producer's, until it reaches limit. */
+	struct blockrng rng;
+};
+
+void blockpipe_start(struct blockpipe *pipe, const struct blockrng *rng,
+		     uint64_t limit, bool threaded);
+
+/* Next block's draw, waiting for it if we have to. */
+struct block_draw blockpipe_next(struct blockpipe *pipe);
+
+/* Once everything below limit has been handed out, the rng is at
+ * limit: copy it out.  Then blockpipe_limit() lets it go on. */
+void blockpipe_rng(struct blockpipe *pipe, struct blockrng *rng);
+void blockpipe_limit(struct blockpipe *pipe, uint64_t limit);
+
+void blockpipe_stop(struct blockpipe *pipe);
+#endif /* BLOCKPIPE_H */
@@ -0,0 +1,77 @@
+#include <ccan/opt/opt.h>
+#include <string.h>
+#include "blockrng.h"
+
+/* Constants from Salmon et al, "Parallel Random Numbers: As Easy as
+ * 1, 2, 3" (SC11). */
+#define PHILOX_M2x64 0xD2B74407B1CE6E93ULL
+#define PHILOX_W64 0x9E3779B97F4A7C15ULL
+
+uint64_t philox_block_hash(uint64_t key, uint64_t block)
+{
+	uint64_t x0 = block, x1 = 0;
+	int round;
+
+	for (round = 0; round < 10; round++) {
+		unsigned __int128 prod = (unsigned __int128)PHILOX_M2x64 * x0;
+
+		x0 = (uint64_t)(prod >> 64) ^ key ^ x1;
+		x1 = (uint64_t)prod;
+		key += PHILOX_W64;
+	}
+	return x0;
+}
+
+void blockrng_init(struct blockrng *rng, enum blockrng_kind kind,
+		   uint64_t seed, uint64_t first)
+{
+	memset(rng, 0, sizeof(*rng));
+	rng->kind = kind;
+	rng->next = first;
+	if (kind == BLOCKRNG_ISAAC)
+		isaac64_init(&rng->isaac, (void *)&seed, sizeof(seed));
+	else
+		rng->key = seed;
+}
+
+uint64_t blockrng_next(struct blockrng *rng)
+{
+	if (rng->kind == BLOCKRNG_ISAAC) {
+		rng->next++;
+		return isaac64_next_uint64(&rng->isaac);
+	}
+	return philox_block_hash(rng->key, rng->next++);
+}
+
+void blockrng_fill(struct blockrng *rng, uint64_t *out, size_t n)
+{
+	size_t k;
+
+	if (rng->kind == BLOCKRNG_ISAAC)
+		isaac64_fill(&rng->isaac, out, n);
+	else {
+		for (k = 0; k < n; k++)
+			out[k] = philox_block_hash(rng->key, rng->next + k);
+	}
+	rng->next += n;
+}
+
+void blockrng_seek(struct blockrng *rng, uint64_t block)
+{
+	if (rng->kind == BLOCKRNG_ISAAC) {
+		while (rng->next < block)
+			blockrng_next(rng);
+	}
+	rng->next = block;
+}
+
+char *opt_set_blockrng(const char *arg, enum blockrng_kind *kind)
+{
+	if (strcmp(arg, "isaac") == 0)
+		*kind = BLOCKRNG_ISAAC;
+	else if (strcmp(arg, "philox") == 0)
+		*kind = BLOCKRNG_PHILOX;
+	else
+		return opt_invalid_argument(arg);
+	return NULL;
+}
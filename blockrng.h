@@ -0,0 +1,42 @@
+#ifndef BLOCKRNG_H
+#define BLOCKRNG_H
+#include <ccan/isaac/isaac64.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Where each block's hash comes from.  isaac64 is the original
+ * sequential stream (so results match older runs); philox is
+ * counter-based, so block i's hash is a pure function of (seed, i) and
+ * any range of blocks can be generated independently. */
+enum blockrng_kind {
+	BLOCKRNG_ISAAC,
+	BLOCKRNG_PHILOX,
+};
+
+struct blockrng {
+	enum blockrng_kind kind;
+	uint64_t key;
+	/* Block the next blockrng_next() is for. */
+	uint64_t next;
+	struct isaac64_ctx isaac;
+};
+
+/* First is the block number of the first hash drawn. */
+void blockrng_init(struct blockrng *rng, enum blockrng_kind kind,
+		   uint64_t seed, uint64_t first);
+
+uint64_t blockrng_next(struct blockrng *rng);
+
+/* The next n hashes, as n calls to blockrng_next() would give. */
+void blockrng_fill(struct blockrng *rng, uint64_t *out, size_t n);
+
+/* Jump ahead so the next hash is for this block (>= rng->next).  O(1)
+ * for philox; isaac has to step through the ones in between. */
+void blockrng_seek(struct blockrng *rng, uint64_t block);
+
+/* Philox2x64-10 of counter (block, 0) under key. */
+uint64_t philox_block_hash(uint64_t key, uint64_t block);
+
+/* For ccan/opt: "isaac" or "philox". */
+char *opt_set_blockrng(const char *arg, enum blockrng_kind *kind);
+#endif /* BLOCKRNG_H */
@@ -138,6 +138,26 @@ uint64_t isaac64_next_uint64(isaac64_ctx *_ctx){
   return _ctx->r[--_ctx->n];
 }
 
+void isaac64_fill(isaac64_ctx *_ctx,uint64_t *_out,size_t _n){
+  while(_n>0){
+    const uint64_t *r;
+    size_t          k;
+    if(!_ctx->n)isaac64_update(_ctx);
+    k=_ctx->n<_n?_ctx->n:_n;
+    r=_ctx->r+_ctx->n;
+    _ctx->n-=k;
+    _n-=k;
+    while(k-->0)*_out++=*--r;
+  }
+}
+
+const uint64_t *isaac64_next_block(isaac64_ctx *_ctx,size_t *_n){
+  if(!_ctx->n)isaac64_update(_ctx);
+  *_n=_ctx->n;
+  _ctx->n=0;
+  return _ctx->r;
+}
+
 uint64_t isaac64_next_uint(isaac64_ctx *_ctx,uint64_t _n){
   uint64_t r;
   uint64_t v;
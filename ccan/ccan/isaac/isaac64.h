@@ -1,6 +1,7 @@
 /* CC0 (Public domain) - see LICENSE file for details */
 #if !defined(_isaac64_H)
 # define _isaac64_H (1)
+# include <stddef.h>
 # include <stdint.h>
 
 
@@ -63,6 +64,26 @@ void isaac64_reseed(isaac64_ctx *_ctx,const unsigned char *_seed,int _nseed);
  * @_ctx: The ISAAC64 instance to generate the value with.
  */
 uint64_t isaac64_next_uint64(isaac64_ctx *_ctx);
+/**
+ * isaac64_fill - Fill an array with the next random 64-bit values.
+ * @_ctx: The ISAAC64 instance to generate the values with.
+ * @_out: Where to put them.
+ * @_n:   How many.
+ * _out[0]..._out[_n-1] are exactly what _n calls to isaac64_next_uint64()
+ *  would have returned, but copied a result block at a time.
+ */
+void isaac64_fill(isaac64_ctx *_ctx,uint64_t *_out,size_t _n);
+/**
+ * isaac64_next_block - Lend out the rest of the current result block.
+ * @_ctx: The ISAAC64 instance to generate the values with.
+ * @_n:   Set to the number of values returned (1 to ISAAC64_SZ).
+ * Generates a fresh block if the current one is used up, then marks all
+ *  of it used.
+ * Return: A pointer into _ctx, valid until the next call on _ctx.
+ *  The values come in reverse: ret[*_n-1] is what isaac64_next_uint64()
+ *  would have returned next, then ret[*_n-2], down to ret[0].
+ */
+const uint64_t *isaac64_next_block(isaac64_ctx *_ctx,size_t *_n);
 /**
  * isaac64_next_uint - Uniform random integer less than the given value.
  * @_ctx: The ISAAC64 instance to generate the value with.
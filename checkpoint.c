@@ -0,0 +1,104 @@
+#include <ccan/err/err.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include "checkpoint.h"
+
+FILE *checkpoint_create(const char *file, const char magic[8])
+{
+	char tmp[strlen(file) + sizeof(".tmp")];
+	FILE *f;
+
+	sprintf(tmp, "%s.tmp", file);
+	f = fopen(tmp, "wb");
+	if (!f)
+		err(1, "Creating checkpoint %s", tmp);
+	checkpoint_write(f, magic, 8);
+	return f;
+}
+
+void checkpoint_commit(FILE *f, const char *file)
+{
+	char tmp[strlen(file) + sizeof(".tmp")];
+
+	sprintf(tmp, "%s.tmp", file);
+	if (fflush(f) != 0 || fsync(fileno(f)) != 0 || fclose(f) != 0)
+		err(1, "Writing checkpoint %s", tmp);
+	if (rename(tmp, file) != 0)
+		err(1, "Renaming checkpoint %s to %s", tmp, file);
+}
+
+FILE *checkpoint_open(const char *file, const char magic[8])
+{
+	char m[8];
+	FILE *f = fopen(file, "rb");
+
+	if (!f)
+		err(1, "Opening checkpoint %s", file);
+	checkpoint_read(f, m, sizeof(m));
+	if (memcmp(m, magic, sizeof(m)) != 0)
+		errx(1, "%s is not a checkpoint for this program", file);
+	return f;
+}
+
+void checkpoint_write(FILE *f, const void *p, size_t len)
+{
+	if (fwrite(p, 1, len, f) != len)
+		err(1, "Writing checkpoint");
+}
+
+void checkpoint_read(FILE *f, void *p, size_t len)
+{
+	if (fread(p, 1, len, f) != len)
+		errx(1, "Checkpoint truncated");
+}
+
+int checkpoint_data_open(const char *file, bool create)
+{
+	char data[strlen(file) + sizeof(".data")];
+	int fd;
+
+	sprintf(data, "%s.data", file);
+	fd = open(data, create ? O_RDWR|O_CREAT|O_TRUNC : O_RDWR, 0666);
+	if (fd < 0)
+		err(1, "Opening checkpoint data %s", data);
+	return fd;
+}
+
+void checkpoint_data_write(int fd, const void *p, size_t len, off_t off)
+{
+	const char *c = p;
+	ssize_t r;
+
+	while (len) {
+		r = pwrite(fd, c, len, off);
+		if (r <= 0)
+			err(1, "Writing checkpoint data");
+		c += r;
+		off += r;
+		len -= r;
+	}
+}
+
+void checkpoint_data_read(int fd, void *p, size_t len, off_t off)
+{
+	char *c = p;
+	ssize_t r;
+
+	while (len) {
+		r = pread(fd, c, len, off);
+		if (r < 0)
+			err(1, "Reading checkpoint data");
+		if (r == 0)
+			errx(1, "Checkpoint data truncated");
+		c += r;
+		off += r;
+		len -= r;
+	}
+}
+
+void checkpoint_data_sync(int fd)
+{
+	if (fsync(fd) != 0)
+		err(1, "Syncing checkpoint data");
+}
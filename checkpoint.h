@@ -0,0 +1,28 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+/* Binary checkpoints for long simulation runs: an 8-byte magic, then
+ * whatever the caller writes, in host byte order (they're only for
+ * resuming on the same box).  We write to <file>.tmp and rename it into
+ * place, so an interrupted write never clobbers the last good one. */
+FILE *checkpoint_create(const char *file, const char magic[8]);
+void checkpoint_commit(FILE *f, const char *file);
+
+FILE *checkpoint_open(const char *file, const char magic[8]);
+
+/* These exit on failure. */
+void checkpoint_write(FILE *f, const void *p, size_t len);
+void checkpoint_read(FILE *f, void *p, size_t len);
+
+/* Data too big to rewrite every time lives beside it, in <file>.data,
+ * written in place at offsets the caller picks.  Only the checkpoint
+ * says how much of that is good, so sync it before committing. */
+int checkpoint_data_open(const char *file, bool create);
+void checkpoint_data_write(int fd, const void *p, size_t len, off_t off);
+void checkpoint_data_read(int fd, void *p, size_t len, off_t off);
+void checkpoint_data_sync(int fd);
+#endif /* CHECKPOINT_H */
@@ -1,28 +1,88 @@
 #include <ccan/array_size/array_size.h>
-#include <ccan/isaac/isaac64.h>
 #include <ccan/ilog/ilog.h>
 #include <ccan/err/err.h>
 #include <ccan/opt/opt.h>
 #include <stdio.h>
 #include <assert.h>
 #include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+#include "prooflen.h"
+#include "checkpoint.h"
+#include "bigalloc.h"
+#include "arena.h"
+#include "blockpipe.h"
+#include "sha256.h"
 
 /* We encode block number and distance (in # hashes) for the previous
  * path. */
 struct path {
-	int blocknum;
-	unsigned int num_hashes;
+	uint64_t blocknum;
+	uint64_t num_hashes;
+};
+
+/* For --merkle: each prev's leaf is its block's hash, and we keep the
+ * hash of the perfect subtree (MMR mountain) of prevs ending at it, so
+ * children sharing a prefix share those. */
+struct prevmerkle {
+	struct sha256 leaf, peak;
+	/* The node ending the mountain before ours. */
+	struct prevnode *prev_peak;
+};
+
+/* A block's prevs are its parent's prevs up to the one it used, plus
+ * the parent.  So they're a list sharing its prefix with the parent's:
+ * each block adds one node, pointing back at the rest. */
+struct prevnode {
+	struct path path;
+	struct prevnode *parent;
+	/* Index in the prevs array. */
+	unsigned int depth;
+	/* The block which added us. */
+	uint64_t id;
+	/* Child nodes and blocks using us. */
+	size_t refs;
+	/* Only with --merkle. */
+	struct prevmerkle merkle[];
 };
 
 struct block {
 	uint64_t hash;
 	/* which prev do we actually jump to. */
 	unsigned int prev_used;
-	/* These are merkled into a tree, but we hold them in an array. */
+	/* These are merkled into a tree, but we hold them in a list. */
 	unsigned int num_prevs;
 	/* This is our distance to the genesis block. */
-	unsigned int hashes_to_genesis;
-	struct path *prevs;
+	uint64_t hashes_to_genesis;
+	/* The last of our prevs. */
+	struct prevnode *prevs;
+};
+
+struct huff_node;
+
+/* Blocks we're keeping, and somewhere to lay out one's prevs.  The
+ * blocks and prevnodes all live in arena, freed by free_chain(). */
+struct chain {
+	struct arena arena;
+	struct block *blocks;
+	size_t mask;
+	/* Released prevnodes, linked by parent, for reuse. */
+	struct prevnode *free_nodes;
+	struct path *scratch;
+	/* Depth of each of scratch's entries in the prevs tree, for
+	 * topologies which can't tell us directly. */
+	unsigned int *depths;
+	/* Huffman's work space, for building depths. */
+	struct huff_node *huff;
+	size_t *huff_parent;
+	size_t scratch_size;
+	/* With --merkle, room for hashing a prevs tree, and stats. */
+	bool merkle;
+	size_t node_size;
+	struct sha256 *merkle_work;
+	uint64_t merkle_hashes;
+	double merkle_secs;
 };
 
 
@@ -37,30 +97,14 @@ struct block {
  *    /\    /\  \
  *   0  1  2  3  4
  */
-static size_t do_proof_len(size_t to, size_t start, size_t end)
-{
-	size_t len;
-
-	/* Reached the node? */
-	if (end - start == 1) {
-		assert(to == start);
-		return 0;
-	}
-
-	len = (1 << (ilog32(end - start - 1) - 1));
-	if (to < start + len)
-		return 1 + do_proof_len(to, start, start + len);
-	return 1 + do_proof_len(to, start + len, end);
-}
-
 static size_t rfc6962_proof_len(const struct path *prevs, size_t num_prevs, size_t to)
 {
-	return do_proof_len(to, 0, num_prevs);
+	return rfc6962_depth(to, num_prevs);
 }
 
 static size_t rev_rfc6962_proof_len(const struct path *prevs, size_t num_prevs, size_t to)
 {
-	return do_proof_len(num_prevs - to - 1, 0, num_prevs);
+	return rfc6962_depth(num_prevs - to - 1, num_prevs);
 }
 
 /*
@@ -89,22 +133,16 @@ static size_t rev_rfc6962_proof_len(const struct path *prevs, size_t num_prevs,
  *   /  \    4  5
  *  /\  /\ 
  * 0 1  2 3
+ *
+ * Both halves are closed form, so this is O(1) and there's nothing a
+ * carried peak table (like merkle's prev_peak chain) could speed up.
  */
 static size_t mmr_proof_len(const struct path *prevs, size_t num, size_t node)
 {
-	size_t mtns = __builtin_popcount(num), off = 0, peaknum = 0;
-	int i;
+	size_t mtns, peaknum, i;
 
 	/* Which mountain is 'node' in? */
-	for (i = sizeof(size_t) * CHAR_BIT - 1; i >= 0; i--) {
-		size_t summit = (size_t)1 << i;
-		if (num & summit) {
-			off += summit;
-			if (node < off)
-				break;
-			peaknum++;
-		}
-	}
+	i = mmr_mountain(num, node, &peaknum, &mtns);
 
 	/* we need to get to mountain i, then down to element. */
 	return rfc6962_proof_len(prevs, mtns, peaknum) + i;
@@ -154,194 +192,716 @@ static size_t naive_proof_len(const struct path *prevs, size_t num_prevs, size_t
 	return naive;
 }
 
+/* Huffman by blocknum, giving every entry's depth.
+ *
+ * A block's prevs are its parent's up to the one used, then the parent
+ * itself: always in blocknum order, which is the order Huffman wants
+ * its leaves.  So no sort: the leaves are a queue, and the combined
+ * nodes come out in score order too, so they're another; each merge
+ * takes the least two heads.  On equal scores the combined nodes go
+ * first, newest first (as the original insertion sort did). */
 struct huff_node {
-	/* If != -1 depth of target. */
-	int depth;
 	size_t score;
+	/* prevs index, or num_prevs + n for the n'th combined node. */
+	size_t node;
 };
 
-static int compare_scores(const void *va, const void *vb)
+/* comb has room for num_prevs, parent for 2 * num_prevs.  If hash
+ * isn't NULL it has the leaves' hashes, and we add each combined
+ * node's after them.  Returns the number of nodes. */
+static size_t huffman_merge(const struct path *prevs, size_t num_prevs,
+			    struct huff_node *comb, size_t *parent,
+			    struct sha256 *hash)
 {
-	const struct huff_node *a = va, *b = vb;
+	size_t i, k, leaf = 0, head = 0, tail = 0, next = num_prevs;
 
-	if (a->score > b->score)
-		return -1;
-	else if (a->score < b->score)
-		return 1;
-	/* FIXME: In real life, must define second key for equal (ie. blocknum) */
-	return 0;
+	while (next < 2 * num_prevs - 1) {
+		size_t score = 0;
+
+		size_t child[2];
+
+		/* Combine least two. */
+		for (k = 0; k < 2; k++) {
+			if (head < tail
+			    && (leaf == num_prevs
+				|| comb[head].score <= prevs[leaf].blocknum)) {
+				child[k] = comb[head].node;
+				score += comb[head++].score;
+			} else {
+				child[k] = leaf;
+				score += prevs[leaf++].blocknum;
+			}
+			parent[child[k]] = next;
+		}
+		if (hash)
+			sha256_pair(&hash[next], &hash[child[0]], &hash[child[1]]);
+
+		for (i = tail++; i > head && comb[i-1].score == score; i--)
+			comb[i] = comb[i-1];
+		comb[i].score = score;
+		comb[i].node = next++;
+	}
+	return next;
+}
+
+static void huffman_depths(const struct path *prevs, size_t num_prevs,
+			   unsigned int *depth,
+			   struct huff_node *comb, size_t *parent)
+{
+	size_t i, next = huffman_merge(prevs, num_prevs, comb, parent, NULL);
+
+	/* Parents come after children, so walk down from the root,
+	 * replacing each parent with its depth. */
+	parent[next - 1] = 0;
+	for (i = next - 1; i-- > 0;)
+		parent[i] = parent[parent[i]] + 1;
+	for (i = 0; i < num_prevs; i++)
+		depth[i] = parent[i];
 }
 
-/* Huffman by blocknum. */
 static size_t huffman_proof_len(const struct path *prevs,
 				size_t num_prevs, size_t to)
 {
-	struct huff_node huff[num_prevs];
-	size_t i;
+	unsigned int *depth = malloc(sizeof(*depth) * num_prevs);
+	struct huff_node *comb = malloc(sizeof(*comb) * num_prevs);
+	size_t *parent = malloc(sizeof(*parent) * 2 * num_prevs), len;
 
-	for (i = 0; i < num_prevs; i++) {
-		if (i == to)
-			huff[i].depth = 0;
-		else
-			huff[i].depth = -1;
-		huff[i].score = prevs[i].blocknum;
-	}
-	qsort(huff, num_prevs, sizeof(huff[0]), compare_scores);
+	huffman_depths(prevs, num_prevs, depth, comb, parent);
+	len = depth[to];
+	free(depth);
+	free(comb);
+	free(parent);
+	return len;
+}
 
-	while (num_prevs != 1) {
-		/* Combine least two. */
-		struct huff_node comb;
-		comb.score = huff[num_prevs-1].score + huff[num_prevs-2].score;
-		comb.depth = -1;
-		if (huff[num_prevs-1].depth != -1)
-			comb.depth = huff[num_prevs-1].depth + 1;
-		else if (huff[num_prevs-2].depth != -1)
-			comb.depth = huff[num_prevs-2].depth + 1;
-		num_prevs--;
-
-		for (i = 0; i < num_prevs - 1; i++)
-			if (huff[i].score < comb.score)
-				break;
-		memmove(huff + i + 1, huff + i, sizeof(huff[i]) * (num_prevs - 1 - i));
-		huff[i] = comb;
+/* Huffman has to build the whole tree to place any one entry, so we
+ * do that once per prevs list, into chain->depths.  The rest are
+ * closed-form: cheaper to ask for just the entries we look at. */
+static bool needs_depths(size_t (*len_func)(const struct path *prevs,
+					    size_t num_prevs, size_t to))
+{
+	return len_func == huffman_proof_len;
+}
+
+/* How deep is prevs[j] in the tree of prevs? */
+static unsigned int prev_depth(const struct chain *chain,
+			       const struct path *prevs, size_t num_prevs,
+			       size_t (*len_func)(const struct path *prevs,
+						  size_t num_prevs, size_t to),
+			       size_t j)
+{
+	if (chain->depths)
+		return chain->depths[j];
+	return len_func(prevs, num_prevs, j);
+}
+
+/* How deep is prevs[j]'s blocknum?  Block 0 is in there twice
+ * (genesis, and as block 1's prev): use the first. */
+static unsigned int proof_len(const struct chain *chain,
+			      const struct path *prevs, size_t num_prevs,
+			      size_t (*len_func)(const struct path *prevs,
+						 size_t num_prevs, size_t to),
+			      size_t j)
+{
+	unsigned int len;
+
+	if (prevs[j].blocknum == 0)
+		j = 0;
+	len = prev_depth(chain, prevs, num_prevs, len_func, j);
+	assert(len);
+	return len;
+}
+
+static struct prevnode *new_prevnode(struct chain *chain,
+				     struct prevnode *parent,
+				     uint64_t id)
+{
+	struct prevnode *n = chain->free_nodes;
+
+	if (n)
+		chain->free_nodes = n->parent;
+	else
+		n = arena_alloc(&chain->arena, chain->node_size);
+
+	n->parent = parent;
+	n->depth = parent ? parent->depth + 1 : 0;
+	n->id = id;
+	n->refs = 1;
+	if (parent)
+		parent->refs++;
+	return n;
+}
+
+static void release_prevs(struct chain *chain, struct prevnode *n)
+{
+	while (n && --n->refs == 0) {
+		struct prevnode *parent = n->parent;
+
+		n->parent = chain->free_nodes;
+		chain->free_nodes = n;
+		n = parent;
 	}
+}
 
-	assert(huff[0].depth >= 0);
-	return huff[0].depth;
+/* The node for prevs[idx], if n is the last. */
+static struct prevnode *prevs_node(struct prevnode *n, size_t idx)
+{
+	while (n->depth != idx)
+		n = n->parent;
+	return n;
 }
-	
-/* How deep is blocknum in the tree of prevs? */
-static int proof_len(const struct path *prevs, size_t num_prevs, int blocknum,
-		     size_t (*len_func)(const struct path *prevs,
-					size_t num_prevs, size_t to))
+
+/* Lay out the list ending in n into chain->scratch, back to the first
+ * entry at or after min_blocknum, and return that entry's index.  The
+ * closed-form topologies only need the entries we look at, which is
+ * usually a handful; Huffman needs them all (and the depths). */
+static size_t prevs_array(struct chain *chain, const struct prevnode *n,
+			  size_t (*len_func)(const struct path *,
+					     size_t, size_t),
+			  uint64_t min_blocknum)
 {
-	size_t i;
+	size_t num_prevs = n->depth + 1, first = n->depth;
 
-	/* Find this blocknum. */
-	for (i = 0; i < num_prevs; i++) {
-		if (prevs[i].blocknum == blocknum) {
-			int len = len_func(prevs, num_prevs, i);
-			assert(len);
-			return len;
+	if (num_prevs > chain->scratch_size) {
+		chain->scratch_size = num_prevs * 2;
+		chain->scratch = realloc(chain->scratch,
+					 sizeof(chain->scratch[0])
+					 * chain->scratch_size);
+		if (needs_depths(len_func)) {
+			chain->depths = realloc(chain->depths,
+						sizeof(chain->depths[0])
+						* chain->scratch_size);
+			chain->huff = realloc(chain->huff,
+					      sizeof(chain->huff[0])
+					      * chain->scratch_size);
+			chain->huff_parent = realloc(chain->huff_parent,
+						     sizeof(chain->huff_parent[0])
+						     * 2 * chain->scratch_size);
 		}
+		if (chain->merkle)
+			chain->merkle_work = realloc(chain->merkle_work,
+						     sizeof(chain->merkle_work[0])
+						     * (2 * chain->scratch_size + 1));
 	}
-	/* It should have been in there... */
-	abort();
+	for (; n; n = n->parent) {
+		if (n->path.blocknum >= min_blocknum)
+			first = n->depth;
+		else if (!chain->depths)
+			break;
+		chain->scratch[n->depth] = n->path;
+	}
+	if (chain->depths)
+		huffman_depths(chain->scratch, num_prevs, chain->depths,
+			       chain->huff, chain->huff_parent);
+	return first;
 }
 
-/* make a copy of prevs from previous block, adding previous block in. */
-static struct path *append_prev(const struct block *prev, int prev_blocknum,
-				unsigned int *path_len,
-				size_t (*len_func)(const struct path *prevs,
-						   size_t, size_t))
+/* Share prevs of previous block up to the one it used, adding previous
+ * block in.  Lays them out from min_blocknum, returning its index. */
+static size_t append_prev(struct chain *chain, struct block *b,
+			  const struct block *prev, uint64_t prev_blocknum,
+			  size_t (*len_func)(const struct path *prevs,
+					     size_t, size_t),
+			  uint64_t min_blocknum)
 {
-	struct path *prevs;
+	struct prevnode *n;
+	const struct path *prevs;
+	size_t first;
 
 	/* We want to include the prev they used, and add one. */
-	*path_len = prev->prev_used + 2;
-	prevs = calloc(sizeof(*prevs), *path_len);
-	memcpy(prevs, prev->prevs, sizeof(*prevs) * (prev->prev_used+1));
-	prevs[prev->prev_used+1].blocknum = prev_blocknum;
-	prevs[prev->prev_used+1].num_hashes = prev->hashes_to_genesis
-		+ proof_len(prevs, *path_len, prev_blocknum, len_func);
+	b->num_prevs = prev->prev_used + 2;
+	n = new_prevnode(chain, prevs_node(prev->prevs, prev->prev_used),
+			 prev_blocknum + 1);
+	n->path.blocknum = prev_blocknum;
+	n->path.num_hashes = 0;
+	first = prevs_array(chain, n, len_func, min_blocknum);
+	prevs = chain->scratch;
+	n->path.num_hashes = prev->hashes_to_genesis
+		+ proof_len(chain, prevs, b->num_prevs, len_func, n->depth);
+	/* Leave chain->scratch (and depths) as our prevs, for the caller. */
+	chain->scratch[n->depth] = n->path;
+	b->prevs = n;
+	return first;
+}
 
-	return prevs;
+/* A new last prev: its leaf, and its mountain's peak from the
+ * mountains ending at the prevs before it. */
+static void merkle_append(struct chain *chain, struct prevnode *n,
+			  uint64_t block_hash)
+{
+	struct prevmerkle *m = n->merkle;
+	const struct prevnode *left = n->parent;
+	unsigned int h;
+
+	memset(&m->leaf, 0, sizeof(m->leaf));
+	memcpy(m->leaf.u8, &block_hash, sizeof(block_hash));
+	m->peak = m->leaf;
+	/* Merge with the left sibling at each height we complete. */
+	for (h = __builtin_ctz(n->depth + 1); h; h--) {
+		sha256_pair(&m->peak, &left->merkle->peak, &m->peak);
+		chain->merkle_hashes++;
+		left = left->merkle->prev_peak;
+	}
+	m->prev_peak = (struct prevnode *)left;
 }
 
-static void print_path_to_target(struct block *blocks,
+/* RFC 6962 tree over hashes[0] ... hashes[num-1]. */
+static void merkle_rfc6962(struct chain *chain, struct sha256 *out,
+			   const struct sha256 *hashes, size_t num)
+{
+	struct sha256 left, right;
+	size_t split;
+
+	if (num == 1) {
+		*out = hashes[0];
+		return;
+	}
+	split = (size_t)1 << (SIZE_BITS - 1 - __builtin_clzl(num - 1));
+	merkle_rfc6962(chain, &left, hashes, split);
+	merkle_rfc6962(chain, &right, hashes + split, num - split);
+	sha256_pair(out, &left, &right);
+	chain->merkle_hashes++;
+}
+
+/* Heap of internal nodes: node r (from 1) holds leaf(r), and its
+ * children are 2r and 2r+1.  Returns node 1's hash. */
+static void merkle_heap(struct chain *chain, struct sha256 *out,
+			const struct sha256 *leaves, size_t num, bool rev)
+{
+	struct sha256 *node = chain->merkle_work + num;
+	size_t r;
+
+	for (r = num; r >= 1; r--) {
+		const struct sha256 *leaf = &leaves[rev ? r - 1 : num - r];
+		unsigned char buf[3 * sizeof(struct sha256)];
+		size_t len = sizeof(*leaf);
+
+		memcpy(buf, leaf, sizeof(*leaf));
+		if (2 * r <= num) {
+			memcpy(buf + len, &node[2 * r], sizeof(node[0]));
+			len += sizeof(node[0]);
+		}
+		if (2 * r + 1 <= num) {
+			memcpy(buf + len, &node[2 * r + 1], sizeof(node[0]));
+			len += sizeof(node[0]);
+		}
+		if (len == sizeof(*leaf))
+			node[r] = *leaf;
+		else {
+			sha256(&node[r], buf, len);
+			chain->merkle_hashes++;
+		}
+	}
+	*out = node[1];
+}
+
+/* Hash the prevs list ending in n into its topology's root.  Mountains
+ * are shared with the parent block, so MMR and RFC 6962 only hash
+ * what's new; the others have to start from the leaves. */
+static void merkle_root(struct chain *chain, const struct prevnode *n,
+			size_t (*len_func)(const struct path *,
+					   size_t, size_t),
+			struct sha256 *root)
+{
+	size_t num_prevs = n->depth + 1, i, width;
+	struct sha256 *work = chain->merkle_work;
+	const struct prevnode *p;
+
+	if (len_func == mmr_proof_len || len_func == rfc6962_proof_len) {
+		struct sha256 peaks[SIZE_BITS];
+		size_t mtns = __builtin_popcountl(num_prevs);
+
+		for (i = mtns, p = n; p; p = p->merkle->prev_peak)
+			peaks[--i] = p->merkle->peak;
+		if (len_func == mmr_proof_len) {
+			merkle_rfc6962(chain, root, peaks, mtns);
+			return;
+		}
+		/* RFC 6962 is the mountains, largest first, folded in
+		 * from the right. */
+		*root = peaks[mtns - 1];
+		for (i = mtns - 1; i-- > 0;) {
+			sha256_pair(root, &peaks[i], root);
+			chain->merkle_hashes++;
+		}
+		return;
+	}
+
+	for (p = n; p; p = p->parent)
+		work[p->depth] = p->merkle->leaf;
+
+	if (len_func == rev_rfc6962_proof_len) {
+		for (i = 0; i < num_prevs / 2; i++) {
+			struct sha256 tmp = work[i];
+			work[i] = work[num_prevs - 1 - i];
+			work[num_prevs - 1 - i] = tmp;
+		}
+		merkle_rfc6962(chain, root, work, num_prevs);
+	} else if (len_func == breadth_proof_len) {
+		merkle_heap(chain, root, work, num_prevs, false);
+	} else if (len_func == rev_breadth_proof_len) {
+		/* The oldest sits on top of the rest. */
+		if (num_prevs == 1) {
+			*root = work[0];
+			return;
+		}
+		merkle_heap(chain, root, work + 1, num_prevs - 1, true);
+		sha256_pair(root, &work[0], root);
+		chain->merkle_hashes++;
+	} else if (len_func == huffman_proof_len) {
+		i = huffman_merge(chain->scratch, num_prevs, chain->huff,
+				  chain->huff_parent, work);
+		chain->merkle_hashes += i - num_prevs;
+		*root = work[i - 1];
+	} else {
+		/* Naive: a perfect tree, padded out with zeroes. */
+		width = (size_t)1 << ilog32(num_prevs);
+		memset(work + num_prevs, 0,
+		       sizeof(work[0]) * (width - num_prevs));
+		for (; width > 1; width /= 2) {
+			for (i = 0; i < width / 2; i++)
+				sha256_pair(&work[i], &work[2*i], &work[2*i+1]);
+			chain->merkle_hashes += width / 2;
+		}
+		*root = work[0];
+	}
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static void print_path_to_target(const char *label, struct chain *chain,
 				 size_t num, size_t target,
 				 size_t (*len_func)(const struct path *,
 						    size_t, size_t))
 {
-	int i;
-	unsigned int distance[num];
+	const struct block *b = &chain->blocks[num-1];
+	const struct path *prevs;
+	uint64_t distance;
+	size_t j;
 
-	distance[target] = 0;
-	for (i = target + 1; i < num; i++) {
-		int j;
+	/* Each block's distance only depends on its own prevs, so we
+	 * only need the last one's. */
+	if (target == num - 1) {
+		distance = 0;
+		goto out;
+	}
 
-		distance[i] = -1;
-		/* Of the prevs we can use, which gives least hashes
-		 * to target? */
-		for (j = blocks[i].prev_used; j < blocks[i].num_prevs; j++) {
-			unsigned int dist;
-			const struct path *prevs = blocks[i].prevs;
+	prevs_array(chain, b->prevs, len_func, 0);
+	prevs = chain->scratch;
+	distance = -1ULL;
+	/* Of the prevs we can use, which gives least hashes to target? */
+	for (j = b->prev_used; j < b->num_prevs; j++) {
+		uint64_t dist;
 
-			dist = prevs[j].num_hashes
-				+ len_func(prevs, blocks[i].num_prevs, j);
-			if (dist < distance[i])
-				distance[i] = dist;
-		}
+		dist = prevs[j].num_hashes
+			+ prev_depth(chain, prevs, b->num_prevs, len_func, j);
+		if (dist < distance)
+			distance = dist;
 	}
+out:
+	printf("%s: proof hashes to target %"PRIu64"\n", label, distance);
+}
+
+struct topology {
+	const char *name;
+	size_t (*len_func)(const struct path *prevs, size_t num_prevs,
+			   size_t to);
+};
+
+static const struct topology topologies[] = {
+	{ "mmr", mmr_proof_len },
+	{ "breadth", breadth_proof_len },
+	{ "rfc6962", rfc6962_proof_len },
+	{ "rev-breadth", rev_breadth_proof_len },
+	{ "rev-rfc6962", rev_rfc6962_proof_len },
+	{ "huffman", huffman_proof_len },
+	{ "naive", naive_proof_len },
+};
+
+static size_t topology_index(size_t (*len_func)(const struct path *,
+						size_t, size_t))
+{
+	size_t t;
 
-	printf("prooflen: proof hashes to target %u\n", distance[num-1]);
+	for (t = 0; t < ARRAY_SIZE(topologies); t++)
+		if (topologies[t].len_func == len_func)
+			return t;
+	abort();
 }
 
-static void print_incremental_length(size_t num, size_t target, size_t seed,
-				     size_t (*len_func)(const struct path *,
-							size_t, size_t))
+/* Checkpoint is this, blockrng, then the prevs nodes we need (all of
+ * them, or just the last block's list with max_skip), parents first,
+ * then each block we keep. */
+#define INCREMENTAL_CHECKPOINT_MAGIC "iptree04"
+struct incremental_checkpoint {
+	uint64_t num, target, seed, rngkind, max_skip, topology;
+	/* Next block to generate, and number of prevnodes. */
+	uint64_t next, num_nodes;
+};
+
+/* Parent is an index into the nodes written before. */
+struct checkpoint_node {
+	int64_t blocknum, num_hashes, parent, id;
+};
+
+/* Each block's node is nodes[id] with the whole chain; otherwise we
+ * write the last block's list from its start, so nodes[depth]. */
+static void write_prevnode(FILE *f, const struct prevnode *n, bool whole)
 {
-	struct block *blocks;
-	size_t i;
-	struct isaac64_ctx isaac;
-
-	isaac64_init(&isaac, (void *)&seed, sizeof(seed));
-	blocks = calloc(sizeof(*blocks), num);
-	blocks[0].prevs = calloc(sizeof(*blocks[0].prevs), 1);
-
-	for (i = 1; i < num; i++) {
-		uint64_t skip, best_distance;
-		int j;
-
-		/* Copy path into this block from previous block, adding
-		 * the prev block. */
-		blocks[i].prevs = append_prev(&blocks[i-1], i-1,
-					      &blocks[i].num_prevs,
-					      len_func);
-
-		/* Now generate block. */
-		blocks[i].hash = isaac64_next_uint64(&isaac);
-		skip = -1ULL / blocks[i].hash;
-		if (skip > i)
-			skip = i;
-
-		/* Find the best previous block we get to (and store in
-		 * prev_used) */
-		best_distance = -1ULL;
-		for (j = 0; j < blocks[i].num_prevs; j ++) {
-			size_t plen;
-
-			/* Can't reach it? */
-			if (blocks[i].prevs[j].blocknum < i - skip)
-				continue;
-			/* How many hashes to get to this prev? */
-			plen = proof_len(blocks[i].prevs, blocks[i].num_prevs,
-					 blocks[i].prevs[j].blocknum,
-					 len_func);
-			if (blocks[i].prevs[j].num_hashes + plen
-			    < best_distance) {
-				/* Use this one. */
-				best_distance = blocks[i].prevs[j].num_hashes
-					+ plen;
-				blocks[i].prev_used = j;
-			}
+	struct checkpoint_node cn;
+
+	cn.blocknum = n->path.blocknum;
+	cn.num_hashes = n->path.num_hashes;
+	if (!n->parent)
+		cn.parent = -1;
+	else
+		cn.parent = whole ? n->parent->id : n->parent->depth;
+	cn.id = n->id;
+	checkpoint_write(f, &cn, sizeof(cn));
+}
+
+static void write_incremental_checkpoint(const char *file,
+					 const struct incremental_checkpoint *hdr,
+					 const struct blockrng *rng,
+					 const struct chain *chain)
+{
+	FILE *f = checkpoint_create(file, INCREMENTAL_CHECKPOINT_MAGIC);
+	struct incremental_checkpoint h = *hdr;
+	bool whole = (chain->mask == SIZE_MAX);
+	const struct block *last = &chain->blocks[(h.next - 1) & chain->mask];
+	size_t i, first;
+
+	h.num_nodes = whole ? h.next : last->prevs->depth + 1;
+	checkpoint_write(f, &h, sizeof(h));
+	checkpoint_write(f, rng, sizeof(*rng));
+	if (whole) {
+		for (i = 0; i < h.next; i++)
+			write_prevnode(f, chain->blocks[i].prevs, whole);
+	} else {
+		for (i = 0; i < h.num_nodes; i++)
+			write_prevnode(f, prevs_node(last->prevs, i), whole);
+	}
+
+	first = whole ? 0 : h.next - 1;
+	for (i = first; i < h.next; i++) {
+		const struct block *b = &chain->blocks[i & chain->mask];
+
+		checkpoint_write(f, &b->hash, sizeof(b->hash));
+		checkpoint_write(f, &b->prev_used, sizeof(b->prev_used));
+		checkpoint_write(f, &b->num_prevs, sizeof(b->num_prevs));
+		checkpoint_write(f, &b->hashes_to_genesis,
+				 sizeof(b->hashes_to_genesis));
+	}
+	checkpoint_commit(f, file);
+}
+
+/* Returns next block to generate. */
+static size_t read_incremental_checkpoint(const char *file,
+					  const struct incremental_checkpoint *expect,
+					  struct blockrng *rng,
+					  struct chain *chain)
+{
+	struct incremental_checkpoint hdr;
+	FILE *f = checkpoint_open(file, INCREMENTAL_CHECKPOINT_MAGIC);
+	bool whole = (chain->mask == SIZE_MAX);
+	struct prevnode **nodes;
+	size_t i, first;
+
+	checkpoint_read(f, &hdr, sizeof(hdr));
+	if (hdr.num != expect->num || hdr.target != expect->target
+	    || hdr.seed != expect->seed || hdr.rngkind != expect->rngkind
+	    || hdr.max_skip != expect->max_skip
+	    || hdr.topology != expect->topology)
+		errx(1, "%s: different num, target, seed, rng, max-skip or topology",
+		     file);
+	if (hdr.next == 0 || hdr.next > hdr.num)
+		errx(1, "%s: bad next block %"PRIu64, file, hdr.next);
+	if (hdr.num_nodes == 0 || hdr.num_nodes > hdr.next + 1)
+		errx(1, "%s: bad node count %"PRIu64, file, hdr.num_nodes);
+
+	checkpoint_read(f, rng, sizeof(*rng));
+	nodes = calloc(sizeof(*nodes), hdr.num_nodes);
+	for (i = 0; i < hdr.num_nodes; i++) {
+		struct checkpoint_node cn;
+
+		checkpoint_read(f, &cn, sizeof(cn));
+		if (cn.parent >= (int64_t)i)
+			errx(1, "%s: bad node %zu", file, i);
+		nodes[i] = new_prevnode(chain,
+					cn.parent < 0 ? NULL : nodes[cn.parent],
+					cn.id);
+		nodes[i]->path.blocknum = cn.blocknum;
+		nodes[i]->path.num_hashes = cn.num_hashes;
+	}
+
+	first = whole ? 0 : hdr.next - 1;
+	for (i = first; i < hdr.next; i++) {
+		struct block *b = &chain->blocks[i & chain->mask];
+
+		checkpoint_read(f, &b->hash, sizeof(b->hash));
+		checkpoint_read(f, &b->prev_used, sizeof(b->prev_used));
+		checkpoint_read(f, &b->num_prevs, sizeof(b->num_prevs));
+		checkpoint_read(f, &b->hashes_to_genesis,
+				sizeof(b->hashes_to_genesis));
+		release_prevs(chain, b->prevs);
+		b->prevs = nodes[whole ? i : hdr.num_nodes - 1];
+		b->prevs->refs++;
+	}
+	/* Blocks (and children) hold the references now. */
+	for (i = 0; i < hdr.num_nodes; i++)
+		release_prevs(chain, nodes[i]);
+	free(nodes);
+	fclose(f);
+	return hdr.next;
+}
+
+/* Don't draw blocks past the next checkpoint (at or after i), where
+ * we save the rng. */
+static size_t draw_limit(size_t num, const char *checkpoint,
+			 size_t every, size_t i)
+{
+	if (checkpoint && i + (every - i % every) % every + 1 < num)
+		return i + (every - i % every) % every + 1;
+	return num;
+}
+
+/* Each block only needs the one before, so unless we want the whole
+ * chain for target, just keep two: blocks are indexed by & mask. */
+static void init_chain(struct chain *chain, size_t num, size_t max_skip,
+		       bool merkle)
+{
+	arena_init(&chain->arena);
+	chain->merkle = merkle;
+	chain->node_size = sizeof(struct prevnode)
+		+ (merkle ? sizeof(struct prevmerkle) : 0);
+	chain->merkle_work = NULL;
+	chain->merkle_hashes = 0;
+	chain->merkle_secs = 0;
+	chain->mask = max_skip ? 1 : SIZE_MAX;
+	chain->blocks = arena_alloc(&chain->arena,
+				    sizeof(*chain->blocks)
+				    * (max_skip ? 2 : num));
+	chain->free_nodes = NULL;
+	chain->scratch = NULL;
+	chain->depths = NULL;
+	chain->huff = NULL;
+	chain->huff_parent = NULL;
+	chain->scratch_size = 0;
+	/* Block 0 has no prevs, but block 1 copies its (zero) entry. */
+	chain->blocks[0].prevs = new_prevnode(chain, NULL, 0);
+	chain->blocks[0].prevs->path.blocknum = 0;
+	chain->blocks[0].prevs->path.num_hashes = 0;
+	if (merkle)
+		merkle_append(chain, chain->blocks[0].prevs, 0);
+}
+
+static void free_chain(struct chain *chain)
+{
+	arena_free(&chain->arena);
+	free(chain->scratch);
+	free(chain->depths);
+	free(chain->huff);
+	free(chain->huff_parent);
+	free(chain->merkle_work);
+}
+
+/* Generate block i, whose hash and skip are in draw. */
+static void add_block(struct chain *chain, size_t i,
+		      const struct block_draw *draw, size_t max_skip,
+		      size_t (*len_func)(const struct path *,
+					 size_t, size_t))
+{
+	struct block *b = &chain->blocks[i & chain->mask];
+	const struct path *prevs;
+	uint64_t skip, best_distance;
+	size_t j;
+
+	if (max_skip)
+		release_prevs(chain, b->prevs);
+
+	/* Now generate block. */
+	b->hash = draw->hash;
+	skip = draw->skip;
+	if (skip > i)
+		skip = i;
+	if (max_skip && skip > max_skip)
+		skip = max_skip;
+
+	/* Share path with previous block, adding the prev block: we
+	 * only need to look at the ones we can reach. */
+	j = append_prev(chain, b, &chain->blocks[(i-1) & chain->mask], i-1,
+			len_func, i - skip);
+	prevs = chain->scratch;
+
+	if (chain->merkle) {
+		struct sha256 root;
+		double start = now();
+
+		merkle_append(chain, b->prevs,
+			      chain->blocks[(i-1) & chain->mask].hash);
+		merkle_root(chain, b->prevs, len_func, &root);
+		chain->merkle_secs += now() - start;
+	}
+
+	/* Find the best previous block we get to (and store in
+	 * prev_used) */
+	best_distance = -1ULL;
+	for (; j < b->num_prevs; j++) {
+		size_t plen;
+
+		/* How many hashes to get to this prev? */
+		plen = proof_len(chain, prevs, b->num_prevs, len_func, j);
+		if (prevs[j].num_hashes + plen
+		    < best_distance) {
+			/* Use this one. */
+			best_distance = prevs[j].num_hashes
+				+ plen;
+			b->prev_used = j;
 		}
-		assert(best_distance != -1ULL);
-		blocks[i].hashes_to_genesis = best_distance;
 	}
+	assert(best_distance != -1ULL);
+	b->hashes_to_genesis = best_distance;
+}
+
+static void print_result(const char *label, struct chain *chain,
+			 size_t num, size_t target,
+			 size_t (*len_func)(const struct path *,
+					    size_t, size_t))
+{
+	const struct block *b;
+	const struct path *prevs;
 
 	/* For specific target, we need to calculate optimal path. */
-	if (target) {
-		print_path_to_target(blocks, num, target, len_func);
-		return;
+	if (target)
+		print_path_to_target(label, chain, num, target, len_func);
+	else {
+		b = &chain->blocks[(num-1) & chain->mask];
+		prevs_array(chain, b->prevs, len_func, 0);
+		prevs = chain->scratch;
+		printf("%s: proof path %u, hashes %"PRIu64"\n", label,
+		       b->num_prevs-1,
+		       prevs[b->prev_used].num_hashes
+		       + proof_len(chain, prevs, b->num_prevs, len_func,
+				   b->prev_used));
 	}
 
-	printf("prooflen: proof path %u, hashes %u\n",
-	       blocks[num-1].num_prevs-1,
-	       blocks[num-1].prevs[blocks[num-1].prev_used].num_hashes
-		+ proof_len(blocks[num-1].prevs, blocks[num-1].num_prevs,
-			    blocks[num-1].prevs[blocks[num-1].prev_used].blocknum,
-			len_func));
+	if (chain->merkle) {
+		printf("%s: merkle hashes %"PRIu64, label,
+		       chain->merkle_hashes);
+		printf(" (%.2f per block)",
+		       (double)chain->merkle_hashes / (num - 1));
+		/* A short run can hash too fast to time. */
+		if (chain->merkle_secs > 0)
+			printf(", %.0f hashes/sec",
+			       chain->merkle_hashes / chain->merkle_secs);
+		printf("\n");
+	}
 
 #if 0
 	for (i = num-1; i; i = blocks[i].prevs[blocks[i].prev_used].blocknum) {
@@ -365,6 +925,149 @@ static void print_incremental_length(size_t num, size_t target, size_t seed,
 #endif
 }
 
+static void print_incremental_length(size_t num, size_t target, size_t seed,
+				     enum blockrng_kind rngkind, bool pipeline,
+				     size_t max_skip, bool merkle,
+				     size_t (*len_func)(const struct path *,
+							size_t, size_t),
+				     const char *checkpoint,
+				     size_t checkpoint_every,
+				     const char *resume)
+{
+	struct chain chain;
+	size_t i;
+	struct blockrng rng;
+	struct blockpipe pipe;
+	struct incremental_checkpoint hdr;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.num = num;
+	hdr.target = target;
+	hdr.seed = seed;
+	hdr.rngkind = rngkind;
+	hdr.max_skip = max_skip;
+	hdr.topology = topology_index(len_func);
+
+	blockrng_init(&rng, rngkind, seed, 1);
+	init_chain(&chain, num, max_skip, merkle);
+
+	i = 1;
+	if (resume)
+		i = read_incremental_checkpoint(resume, &hdr, &rng, &chain);
+
+	blockpipe_start(&pipe, &rng, draw_limit(num, checkpoint,
+						checkpoint_every, i),
+			pipeline);
+	for (; i < num; i++) {
+		struct block_draw draw = blockpipe_next(&pipe);
+
+		add_block(&chain, i, &draw, max_skip, len_func);
+
+		if (checkpoint && i % checkpoint_every == 0 && i + 1 < num) {
+			hdr.next = i + 1;
+			blockpipe_rng(&pipe, &rng);
+			write_incremental_checkpoint(checkpoint, &hdr, &rng,
+						     &chain);
+			blockpipe_limit(&pipe, draw_limit(num, checkpoint,
+							 checkpoint_every,
+							 i + 1));
+		}
+	}
+	blockpipe_stop(&pipe);
+
+	print_result("prooflen", &chain, num, target, len_func);
+	free_chain(&chain);
+}
+
+/* --all: one chain, every topology.  One thread draws a chunk of
+ * blocks, then each topology's thread adds them to its own blocks. */
+#define ALL_CHUNK 4096
+struct all_run {
+	size_t num, max_skip;
+	struct blockpipe pipe;
+	struct block_draw draw[ALL_CHUNK];
+	/* Blocks in draw[] are start ... start+n-1. */
+	size_t start, n;
+	pthread_barrier_t barrier;
+};
+
+struct all_worker {
+	pthread_t thread;
+	struct all_run *run;
+	const struct topology *topo;
+	struct chain chain;
+};
+
+static void *all_worker(void *arg)
+{
+	struct all_worker *w = arg;
+	struct all_run *run = w->run;
+	size_t k;
+
+	for (;;) {
+		/* Everyone's done with the last chunk: draw the next. */
+		if (pthread_barrier_wait(&run->barrier)
+		    == PTHREAD_BARRIER_SERIAL_THREAD) {
+			run->start += run->n;
+			run->n = run->num - run->start;
+			if (run->n > ALL_CHUNK)
+				run->n = ALL_CHUNK;
+			for (k = 0; k < run->n; k++)
+				run->draw[k] = blockpipe_next(&run->pipe);
+		}
+		pthread_barrier_wait(&run->barrier);
+		if (!run->n)
+			break;
+
+		for (k = 0; k < run->n; k++)
+			add_block(&w->chain, run->start + k,
+				  &run->draw[k], run->max_skip,
+				  w->topo->len_func);
+	}
+	return NULL;
+}
+
+static void print_all_lengths(size_t num, size_t target, size_t seed,
+			      enum blockrng_kind rngkind, bool pipeline,
+			      size_t max_skip, bool merkle)
+{
+	struct all_run *run = calloc(sizeof(*run), 1);
+	struct all_worker worker[ARRAY_SIZE(topologies)];
+	struct blockrng rng;
+	size_t t;
+
+	run->num = num;
+	run->max_skip = max_skip;
+	run->start = 1;
+	run->n = 0;
+	blockrng_init(&rng, rngkind, seed, 1);
+	blockpipe_start(&run->pipe, &rng, num, pipeline);
+	pthread_barrier_init(&run->barrier, NULL, ARRAY_SIZE(topologies));
+
+	for (t = 0; t < ARRAY_SIZE(topologies); t++) {
+		worker[t].run = run;
+		worker[t].topo = &topologies[t];
+		init_chain(&worker[t].chain, num, max_skip, merkle);
+		if (pthread_create(&worker[t].thread, NULL,
+				   all_worker, &worker[t]) != 0)
+			err(1, "Creating thread %zu", t);
+	}
+	for (t = 0; t < ARRAY_SIZE(topologies); t++)
+		pthread_join(worker[t].thread, NULL);
+	pthread_barrier_destroy(&run->barrier);
+	blockpipe_stop(&run->pipe);
+
+	for (t = 0; t < ARRAY_SIZE(topologies); t++) {
+		char label[sizeof("prooflen-") + strlen(topologies[t].name)];
+
+		sprintf(label, "prooflen-%s", topologies[t].name);
+		print_result(label, &worker[t].chain, num, target,
+			     topologies[t].len_func);
+		free_chain(&worker[t].chain);
+	}
+	free(run);
+}
+
 static char *opt_set_breadth(size_t (**len_func)(const struct path *prevs,
 						 size_t to, size_t start))
 {
@@ -409,7 +1112,13 @@ static char *opt_set_naive(size_t (**len_func)(const struct path *prevs,
 
 int main(int argc, char *argv[])
 {
-	unsigned int num, seed = 0, target = 0;
+	unsigned long num, target = 0, max_skip = 0;
+	unsigned int seed = 0;
+	unsigned long checkpoint_every = 100000;
+	char *checkpoint = NULL, *resume = NULL, *backing_dir = NULL;
+	bool huge_pages = false;
+	enum blockrng_kind rngkind = BLOCKRNG_ISAAC;
+	bool pipeline = false, all = false, merkle = false;
 	size_t (*len_func)(const struct path *prevs, size_t num_prevs, size_t to)
 		= mmr_proof_len;
 
@@ -418,7 +1127,7 @@ int main(int argc, char *argv[])
 			   "Calculates proof length for SPV chains of block headers,\n"
 			   " using various different prevtree topologies",
 			   "Print this message");
-	opt_register_arg("--target", opt_set_uintval, opt_show_uintval, &target,
+	opt_register_arg("--target", opt_set_ulongval, opt_show_ulongval, &target,
 			 "Block number to terminate SPV proof at");
 	opt_register_noarg("--breadth", opt_set_breadth, &len_func,
 			 "Use breadth-first tree for path");
@@ -432,17 +1141,56 @@ int main(int argc, char *argv[])
 			 "Use huffman tree for path");
 	opt_register_noarg("--naive", opt_set_naive, &len_func,
 			 "Use naive tree for path");
+	opt_register_noarg("--all", opt_set_bool, &all,
+			   "Use every topology (one thread each) on one chain");
+	opt_register_noarg("--merkle", opt_set_bool, &merkle,
+			   "Hash each block's prevs into a SHA-256 Merkle root");
 	opt_register_arg("--seed", opt_set_uintval, opt_show_uintval, &seed,
 			 "Seed for deterministic RNG");
+	opt_register_arg("--rng", opt_set_blockrng, NULL, &rngkind,
+			 "Block hash generator: isaac (default) or philox");
+	opt_register_noarg("--pipeline", opt_set_bool, &pipeline,
+			   "Draw blocks on a separate producer thread");
+	opt_register_arg("--max-skip", opt_set_ulongval, opt_show_ulongval,
+			 &max_skip, "Cap skips, keeping only the last block");
+	opt_register_arg("--checkpoint", opt_set_charp, NULL, &checkpoint,
+			 "File to save progress to");
+	opt_register_arg("--checkpoint-every", opt_set_ulongval,
+			 opt_show_ulongval, &checkpoint_every,
+			 "Blocks between checkpoints");
+	opt_register_arg("--resume", opt_set_charp, NULL, &resume,
+			 "Continue from this checkpoint");
+	opt_register_arg("--backing-file", opt_set_charp, NULL, &backing_dir,
+			 "Directory for file-backed block array");
+	opt_register_noarg("--huge-pages", opt_set_bool, &huge_pages,
+			   "Ask for transparent huge pages for block array");
 
 	opt_parse(&argc, argv, opt_log_stderr_exit);
 	if (argc != 2)
 		opt_usage_and_exit(NULL);
 
-	num = atoi(argv[1]);
+	num = strtoul(argv[1], NULL, 0);
+	/* Genesis alone has no prevs to prove anything with. */
+	if (num < 2)
+		errx(1, "Need at least 2 blocks");
 	if (target >= num)
 		errx(1, "Don't do that, you'll crash me");
-	print_incremental_length(num, target, seed, len_func);
+	if (target && max_skip)
+		errx(1, "--target needs the whole chain, not --max-skip");
+	if (checkpoint_every == 0)
+		errx(1, "--checkpoint-every must be non-zero");
+	if (all && (checkpoint || resume))
+		errx(1, "--all doesn't do --checkpoint or --resume");
+	if (merkle && (checkpoint || resume))
+		errx(1, "--merkle doesn't do --checkpoint or --resume");
+	bigalloc_setup(backing_dir, huge_pages);
+	if (all)
+		print_all_lengths(num, target, seed, rngkind, pipeline,
+				  max_skip, merkle);
+	else
+		print_incremental_length(num, target, seed, rngkind, pipeline,
+					 max_skip, merkle, len_func, checkpoint,
+					 checkpoint_every, resume);
 
 	return 0;
 }
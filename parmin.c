@@ -0,0 +1,155 @@
+#include <ccan/err/err.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "parmin.h"
+
+struct parmin_result {
+	unsigned int min;
+	size_t minj;
+};
+
+struct parmin_pool {
+	pthread_t *threads;
+	size_t nthreads;
+	/* Held for a whole job, so only one runs at a time. */
+	pthread_mutex_t job_lock;
+	/* Protects generation, busy and stop. */
+	pthread_mutex_t lock;
+	pthread_cond_t start, done;
+	size_t generation, busy;
+	bool stop;
+
+	/* The current job: chunk c is hi - c*PARMIN_CHUNK downwards. */
+	size_t lo, hi, nchunks;
+	parmin_fn fn;
+	void *arg;
+	struct parmin_result *res;
+	atomic_size_t next_chunk;
+};
+
+static void do_chunks(struct parmin_pool *pool)
+{
+	size_t c;
+
+	while ((c = atomic_fetch_add(&pool->next_chunk, 1)) < pool->nchunks) {
+		size_t chi = pool->hi - c * PARMIN_CHUNK, clo;
+
+		if (chi - pool->lo >= PARMIN_CHUNK)
+			clo = chi - PARMIN_CHUNK + 1;
+		else
+			clo = pool->lo;
+		pool->res[c].min = -1;
+		pool->res[c].minj = chi;
+		pool->fn(clo, chi, pool->arg,
+			 &pool->res[c].min, &pool->res[c].minj);
+	}
+}
+
+static void *parmin_worker(void *arg)
+{
+	struct parmin_pool *pool = arg;
+	size_t seen = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (pool->generation == seen && !pool->stop)
+			pthread_cond_wait(&pool->start, &pool->lock);
+		if (pool->stop)
+			break;
+		seen = pool->generation;
+		pthread_mutex_unlock(&pool->lock);
+
+		do_chunks(pool);
+
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->busy == 0)
+			pthread_cond_signal(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+struct parmin_pool *parmin_pool_new(size_t nthreads)
+{
+	struct parmin_pool *pool;
+	size_t t;
+
+	if (!nthreads)
+		return NULL;
+	pool = calloc(sizeof(*pool), 1);
+	pool->nthreads = nthreads;
+	pool->threads = calloc(sizeof(*pool->threads), nthreads);
+	pthread_mutex_init(&pool->job_lock, NULL);
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->start, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	for (t = 0; t < nthreads; t++)
+		if (pthread_create(&pool->threads[t], NULL,
+				   parmin_worker, pool) != 0)
+			err(1, "Creating scan thread %zu", t);
+	return pool;
+}
+
+void parmin_pool_free(struct parmin_pool *pool)
+{
+	size_t t;
+
+	if (!pool)
+		return;
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+	for (t = 0; t < pool->nthreads; t++)
+		pthread_join(pool->threads[t], NULL);
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->start);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_mutex_destroy(&pool->job_lock);
+	free(pool->threads);
+	free(pool);
+}
+
+void parmin(struct parmin_pool *pool, size_t lo, size_t hi,
+	    parmin_fn fn, void *arg, unsigned int *min, size_t *minj)
+{
+	size_t c;
+
+	if (!pool || hi - lo < PARMIN_THRESHOLD) {
+		fn(lo, hi, arg, min, minj);
+		return;
+	}
+
+	pthread_mutex_lock(&pool->job_lock);
+	pool->lo = lo;
+	pool->hi = hi;
+	pool->nchunks = (hi - lo) / PARMIN_CHUNK + 1;
+	pool->fn = fn;
+	pool->arg = arg;
+	pool->res = malloc(sizeof(*pool->res) * pool->nchunks);
+	atomic_store(&pool->next_chunk, 0);
+
+	pthread_mutex_lock(&pool->lock);
+	pool->busy = pool->nthreads;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+
+	do_chunks(pool);
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->busy)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+
+	/* Chunks go from the top down, so strict < keeps ties high. */
+	for (c = 0; c < pool->nchunks; c++) {
+		if (pool->res[c].min < *min) {
+			*min = pool->res[c].min;
+			*minj = pool->res[c].minj;
+		}
+	}
+	free(pool->res);
+	pthread_mutex_unlock(&pool->job_lock);
+}
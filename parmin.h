@@ -0,0 +1,34 @@
+#ifndef PARMIN_H
+#define PARMIN_H
+#include <stdlib.h>
+
+/* Parallel min-reduction for the rare blocks whose skip reaches back
+ * millions of blocks.  The range is cut into chunks which the pool's
+ * threads (and the caller) grab as they go, so a slow chunk doesn't
+ * hold up the rest; the per-chunk minima are then combined in order,
+ * so the answer doesn't depend on who did what. */
+
+/* Worth splitting a scan at least this long. */
+#ifndef PARMIN_THRESHOLD
+#define PARMIN_THRESHOLD (1 << 16)
+#endif
+#ifndef PARMIN_CHUNK
+#define PARMIN_CHUNK (1 << 14)
+#endif
+
+/* Scan [lo, hi] from the top down, lowering *min (strictly) and
+ * setting *minj: ie. ties go to the highest j, like the serial DP. */
+typedef void (*parmin_fn)(size_t lo, size_t hi, void *arg,
+			  unsigned int *min, size_t *minj);
+
+struct parmin_pool;
+
+/* nthreads helpers besides the caller; NULL if nthreads is 0. */
+struct parmin_pool *parmin_pool_new(size_t nthreads);
+void parmin_pool_free(struct parmin_pool *pool);
+
+/* Same as fn(lo, hi, arg, min, minj).  Serial if pool is NULL or the
+ * range is short; callers from several threads take turns. */
+void parmin(struct parmin_pool *pool, size_t lo, size_t hi,
+	    parmin_fn fn, void *arg, unsigned int *min, size_t *minj);
+#endif /* PARMIN_H */
@@ -0,0 +1,45 @@
+#ifndef PROOFLEN_H
+#define PROOFLEN_H
+#include <stdlib.h>
+#include <limits.h>
+
+/* Closed-form tree proof lengths, shared by test-trees and
+ * incremental-proof-tree.  These run in the innermost loop of every
+ * DP, so no recursion or bit-by-bit loops. */
+
+#define SIZE_BITS (sizeof(size_t) * CHAR_BIT)
+
+/* Number of hashes to prove leaf 'to' in an RFC 6962 tree of 'num'
+ * leaves.  The tree splits at the top bit of the last index: if
+ * 'to' has that bit too we go right (one hash) and drop the bit,
+ * otherwise we land in a complete tree of that height.  So it's one
+ * hash for each bit of 'last' above where they first differ, plus
+ * the complete tree below that. */
+static inline size_t rfc6962_depth(size_t to, size_t num)
+{
+	size_t last = num - 1, diff = to ^ last, b;
+
+	if (!diff)
+		return __builtin_popcountl(last);
+
+	b = SIZE_BITS - 1 - __builtin_clzl(diff);
+	return __builtin_popcountl(last >> b >> 1) + 1 + b;
+}
+
+/* Which MMR mountain of 'num' elements is 'to' in?  Mountains are the
+ * set bits of 'num', largest first, so it's the top bit where 'num'
+ * has a 1 and 'to' doesn't.  Returns the mountain's height; *peaknum
+ * is how many mountains precede it, *mtns the total.
+ *
+ * 'to' must be below 'num'; the | 1 only stops to == num reaching
+ * __builtin_clzl(0), which is undefined. */
+static inline size_t mmr_mountain(size_t num, size_t to,
+				  size_t *peaknum, size_t *mtns)
+{
+	size_t height = SIZE_BITS - 1 - __builtin_clzl((num ^ to) | 1);
+
+	*peaknum = __builtin_popcountl(num >> height >> 1);
+	*mtns = __builtin_popcountl(num);
+	return height;
+}
+#endif /* PROOFLEN_H */
@@ -0,0 +1,16 @@
+#ifndef SHA256_H
+#define SHA256_H
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Plain FIPS 180-4 SHA-256, for hashing real Merkle trees. */
+struct sha256 {
+	unsigned char u8[32];
+};
+
+void sha256(struct sha256 *out, const void *p, size_t len);
+
+/* SHA-256 of a then b: an internal Merkle node. */
+void sha256_pair(struct sha256 *out,
+		 const struct sha256 *a, const struct sha256 *b);
+#endif /* SHA256_H */
@@ -4,57 +4,113 @@
 #include <assert.h>
 #include <ccan/isaac/isaac64.h>
 #include <ccan/isaac/isaac64.c>
+#include "parmin.h"
+
+/* Scan for parmin: the lowest dist[j & mask] in [lo, hi]. */
+struct dist_scan {
+	const int *dist;
+	long mask;
+};
+
+static void dist_scan(size_t lo, size_t hi, void *arg,
+		      unsigned int *min, size_t *minj)
+{
+	const struct dist_scan *ds = arg;
+	size_t j;
+
+	for (j = hi; j + 1 > lo; j--)
+		if (1 + ds->dist[j & ds->mask] < *min) {
+			*min = 1 + ds->dist[j & ds->mask];
+			*minj = j;
+		}
+}
 
 int main(int argc, char *argv[])
 {
 	struct isaac64_ctx isaac;
-	int num, i, seed, *dist, *cache, cachesize;
+	long num, i, max_skip, mask, *cache, cachestart, cacheend;
+	int seed, *dist;
+	const uint64_t *hashes;
+	size_t nhashes = 0;
+	struct parmin_pool *pool;
+	struct dist_scan ds;
 
 	if (argc < 2)
-		errx(1, "Usage: %s <blockheight> [<seed>]\n"
-		     "  Prints optimal compact SPV length to genesis", argv[0]);
-	num = atoi(argv[1]);
+		errx(1, "Usage: %s <blockheight> [<seed>] [<max-skip>]"
+		     " [<scan-threads>]\n"
+		     "  Prints optimal compact SPV length to genesis\n"
+		     "  (with max-skip, only keeps that many blocks;\n"
+		     "   with scan-threads, splits huge skips across them)",
+		     argv[0]);
+	num = atol(argv[1]);
 	seed = atoi(argv[2] ? argv[2] : "0");
+	max_skip = argc > 3 ? atol(argv[3]) : 0;
+	pool = parmin_pool_new(argc > 4 ? atol(argv[4]) : 0);
 	isaac64_init(&isaac, (void *)&seed, sizeof(seed));
 
-	dist = calloc(sizeof(*dist), num);
-	cache = calloc(sizeof(*dist), num);
-	cachesize = 1;
+	/* If we can only skip max_skip back, we only need a ring of
+	 * that many: both arrays are indexed & mask. */
+	if (max_skip > 0 && max_skip < num) {
+		for (mask = 1; mask < max_skip + 1; mask *= 2);
+		dist = calloc(sizeof(*dist), mask);
+		cache = calloc(sizeof(*cache), mask);
+		mask--;
+	} else {
+		max_skip = num;
+		mask = -1;
+		dist = calloc(sizeof(*dist), num);
+		cache = calloc(sizeof(*cache), num);
+	}
+	ds.dist = dist;
+	ds.mask = mask;
+
+	/* Cache is entries cachestart to cacheend-1. */
+	cachestart = 0;
+	cacheend = 1;
 
 	for (i = 1; i < num; i++) {
 		/* We can skip more if we're better than required. */
-		uint64_t skip = -1ULL / isaac64_next_uint64(&isaac);
-		int j, best, next_step;
+		uint64_t skip;
+		long j;
+		size_t next_step;
+		unsigned int best;
 
+		/* Use isaac's result block in place (it's backwards). */
+		if (!nhashes)
+			hashes = isaac64_next_block(&isaac, &nhashes);
+		skip = -1ULL / hashes[--nhashes];
 		if (skip > i)
 			skip = i;
+		if (skip > max_skip)
+			skip = max_skip;
 
 		/* We can always get back there one step at a time. */
-		best = dist[i-1] + 1;
-		next_step = i-1;
-		for (j = i-1; j >= (int)(i-skip); j--)
-			if (1 + dist[j] < best) {
-				best = 1 + dist[j];
-				next_step = j;
-			}
+		best = -1;
+		parmin(pool, i-skip, i-1, dist_scan, &ds, &best, &next_step);
+
+		dist[i & mask] = best;
+		printf("%li: %u steps\n", i, best);
 
-		dist[i] = best;
-		printf("%i: %u steps\n", i, best);
+		/* Nothing can ever reach those below i - max_skip again. */
+		while (cachestart < cacheend - 1
+		       && cache[cachestart & mask] < i - max_skip)
+			cachestart++;
 
 		/* If we can reach any in cache, do that, and trim cache */
-		for (j = 0; j < cachesize; j++) {
-			if (i - skip <= cache[j]) {
-				cachesize = j+1;
+		for (j = cachestart; j < cacheend; j++) {
+			if (i - skip <= cache[j & mask]) {
+				cacheend = j+1;
 				goto next;
 			}
 		}
 
 		/* Add this to cache. */
-		cache[cachesize++] = i;
+		cache[cacheend++ & mask] = i;
 	next:
-		assert(cache[cachesize-1] == next_step);
+		assert(cache[(cacheend-1) & mask] == next_step);
 	}
 	printf("Steps: %u\n", seed);
+	parmin_pool_free(pool);
 
 	return 0;
 }
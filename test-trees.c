@@ -1,17 +1,54 @@
 #include <ccan/array_size/array_size.h>
-#include <ccan/isaac/isaac64.h>
+#include <ccan/build_assert/build_assert.h>
 #include <ccan/ilog/ilog.h>
 #include <ccan/err/err.h>
 #include <ccan/opt/opt.h>
 #include <stdio.h>
 #include <assert.h>
 #include <string.h>
-
-/* We keep a cache of luckiest. */
+#include <pthread.h>
+#include <inttypes.h>
+#include <math.h>
+#include <unistd.h>
+#include "prooflen.h"
+#include "checkpoint.h"
+#include "bigalloc.h"
+#include "blockpipe.h"
+#include "parmin.h"
+
+/* We keep a cache of luckiest (must be a power of 2, >= 64).  The
+ * styles only care about the best 16, 32 and 64 of these, so each of
+ * those tiers is its own min-heap: everything in a tier beats
+ * everything in the next. */
 #define CACHE_SIZE 64
+#define CACHE_TIERS 4
+static const size_t cache_tier_end[CACHE_TIERS] = { 16, 32, 64, CACHE_SIZE };
+
+/* Huffman trees over the best HUFF_SMALL and HUFF_SIZE entries. */
+#define HUFF_SMALL 32
+#define HUFF_SIZE 64
+
+struct cache_entry {
+	size_t blocknum;
+	size_t skip;
+};
+
+/* Hash index from blocknum to where it is in the cache. */
+#define CACHE_HASH_SIZE (CACHE_SIZE * 4)
+struct cache_slot {
+	/* 0 if unused: we never cache block 0. */
+	size_t blocknum;
+	unsigned int tier;
+	unsigned int huffdepth_small, huffdepth;
+};
+
 struct cache {
-	int blocknum;
-	int skip;
+	/* Tier t is a min-heap in e[cache_tier_start(t)...]. */
+	struct cache_entry e[CACHE_SIZE];
+	size_t num[CACHE_TIERS];
+	struct cache_slot slot[CACHE_HASH_SIZE];
+	/* Unfilled entries have blocknum 0 and skip 0: their depths. */
+	unsigned int empty_huffdepth_small, empty_huffdepth;
 };
 
 /* Trees with internal values look like so (from Maaku's Merkelized Prefix tree
@@ -48,13 +85,19 @@ static size_t prooflen_for_internal_node(size_t depth)
  *
  * The depth of a node == log2(dist). */
 static size_t optimal_proof_len(size_t from, size_t to, const struct cache *c,
-				const int *step)
+				const size_t *step)
 {
 	size_t depth = ilog32(from - to);
 
 	return prooflen_for_internal_node(depth);
 }
 
+/* Cost only depends on ilog(from - to), all the way back. */
+static size_t optimal_band_floor(size_t from)
+{
+	return 0;
+}
+
 /* RFC 6962 approach is just to built the tree from an array, in order,
  * using external nodes:
  *
@@ -66,26 +109,10 @@ static size_t optimal_proof_len(size_t from, size_t to, const struct cache *c,
  *    /\    /\  \
  *   0  1  2  3  4
  */
-static size_t do_proof_len(size_t to, size_t start, size_t end)
-{
-	size_t len;
-
-	/* Reached the node? */
-	if (end - start == 1) {
-		assert(to == start);
-		return 0;
-	}
-
-	len = (1 << (ilog32(end - start - 1) - 1));
-	if (to < start + len)
-		return 1 + do_proof_len(to, start, start + len);
-	return 1 + do_proof_len(to, start + len, end);
-}
-
 static size_t rfc6962_proof_len(size_t from, size_t to, const struct cache *c,
-				const int *step)
+				const size_t *step)
 {
-	return do_proof_len(to, 0, from);
+	return rfc6962_depth(to, from);
 }
 
 /*
@@ -144,14 +171,20 @@ static size_t batch_proof_len(size_t from, size_t to, bool array)
 
 static size_t breadth_batch_proof_len(size_t from, size_t to,
 				      const struct cache *c,
-				      const int *step)
+				      const size_t *step)
 {
 	return batch_proof_len(from, to, false);
 }
 
+/* Within the tree we're building, it's optimal (plus a constant). */
+static size_t breadth_batch_band_floor(size_t from)
+{
+	return from / SUBTREE_SIZE * SUBTREE_SIZE;
+}
+
 static size_t rfc6962_batch_proof_len(size_t from, size_t to,
 				      const struct cache *c,
-				      const int *step)
+				      const size_t *step)
 {
 	return batch_proof_len(from, to, true);
 }
@@ -196,19 +229,10 @@ static size_t rfc6962_batch_proof_len(size_t from, size_t to,
  */
 static size_t mmr_variant_proof_len(size_t from, size_t to, bool linear)
 {
-	size_t mtns = __builtin_popcount(from), off = 0, peaknum = 0;
-	int i;
+	size_t mtns, peaknum, i;
 
 	/* Which mountain is 'to' in? */
-	for (i = sizeof(size_t) * CHAR_BIT - 1; i >= 0; i--) {
-		size_t summit = (size_t)1 << i;
-		if (from & summit) {
-			off += summit;
-			if (to < off)
-				break;
-			peaknum++;
-		}
-	}
+	i = mmr_mountain(from, to, &peaknum, &mtns);
 
 	/* we need to get to mountain i, then down to element. */
 	if (linear) {
@@ -221,91 +245,389 @@ static size_t mmr_variant_proof_len(size_t from, size_t to, bool linear)
 }
 
 static size_t mmr_proof_len(size_t from, size_t to, const struct cache *c,
-			    const int *step)
+			    const size_t *step)
 {
 	return mmr_variant_proof_len(from, to, false);
 }
 
 static size_t mmr_linear_proof_len(size_t from, size_t to,
 				   const struct cache *c,
-				   const int *step)
+				   const size_t *step)
 {
 	return mmr_variant_proof_len(from, to, true);
 }
 
-static void init_cache(struct cache *cache)
+/* Batch versions fill out[to - lo] for every 'to' in [lo, hi].  For
+ * these styles the length is constant over runs of 'to', so we only
+ * calculate it once per run, and the rest is just filling. */
+static void fill_lens(unsigned int *out, size_t n, unsigned int len)
 {
-	int i;
+	size_t i;
 
-	for (i = 0; i < CACHE_SIZE; i++)
-		cache[i].skip = cache[i].blocknum = 0;
+	for (i = 0; i < n; i++)
+		out[i] = len;
 }
 
-static void add_to_cache(struct cache *cache,
-			 int skip, int blocknum)
+/* Length only depends on the top bit where 'to' differs from key:
+ * runs are aligned power-of-two blocks. */
+static void xor_runs_proof_lens(size_t from, size_t key, size_t lo, size_t hi,
+				size_t (*proof_len)(size_t, size_t,
+						    const struct cache *,
+						    const size_t *),
+				unsigned int *out)
 {
-	int i;
+	size_t j = hi;
 
-	if (skip <= cache[CACHE_SIZE-1].skip)
-		return;
+	for (;;) {
+		size_t start = j;
+
+		if (j != key) {
+			size_t b = SIZE_BITS - 1 - __builtin_clzl(j ^ key);
+			start = j & ~(((size_t)1 << b) - 1);
+			if (start < lo)
+				start = lo;
+		}
+		fill_lens(out + start - lo, j - start + 1,
+			  proof_len(from, j, NULL, NULL));
+		if (start == lo)
+			break;
+		j = start - 1;
+	}
+}
+
+/* Length only depends on ilog(from - to): runs are distance bands. */
+static void dist_bands_proof_lens(size_t from, size_t lo, size_t hi,
+				  size_t (*proof_len)(size_t, size_t,
+						      const struct cache *,
+						      const size_t *),
+				  unsigned int *out)
+{
+	size_t j = hi;
+
+	for (;;) {
+		size_t d = from - j, start;
+		size_t dhi = ((size_t)2 << (SIZE_BITS - 1 - __builtin_clzl(d))) - 1;
+
+		if (dhi >= from - lo)
+			start = lo;
+		else
+			start = from - dhi;
+		fill_lens(out + start - lo, j - start + 1,
+			  proof_len(from, j, NULL, NULL));
+		if (start == lo)
+			break;
+		j = start - 1;
+	}
+}
+
+static void rfc6962_proof_lens(size_t from, size_t lo, size_t hi,
+			       const struct cache *c, const size_t *step,
+			       unsigned int *out)
+{
+	xor_runs_proof_lens(from, from - 1, lo, hi, rfc6962_proof_len, out);
+}
+
+static void optimal_proof_lens(size_t from, size_t lo, size_t hi,
+			       const struct cache *c, const size_t *step,
+			       unsigned int *out)
+{
+	dist_bands_proof_lens(from, lo, hi, optimal_proof_len, out);
+}
+
+static void mmr_proof_lens(size_t from, size_t lo, size_t hi,
+			   const struct cache *c, const size_t *step,
+			   unsigned int *out)
+{
+	xor_runs_proof_lens(from, from, lo, hi, mmr_proof_len, out);
+}
+
+static void mmr_linear_proof_lens(size_t from, size_t lo, size_t hi,
+				  const struct cache *c, const size_t *step,
+				  unsigned int *out)
+{
+	xor_runs_proof_lens(from, from, lo, hi, mmr_linear_proof_len, out);
+}
+
+static size_t cache_tier_start(size_t tier)
+{
+	return tier ? cache_tier_end[tier-1] : 0;
+}
+
+/* Does a rank below b?  Equal skips keep the earlier block. */
+static bool cache_worse(const struct cache_entry *a,
+			const struct cache_entry *b)
+{
+	if (a->skip != b->skip)
+		return a->skip < b->skip;
+	return a->blocknum > b->blocknum;
+}
+
+static int cache_entry_cmp(const void *va, const void *vb)
+{
+	const struct cache_entry *a = va, *b = vb;
+
+	if (cache_worse(a, b))
+		return 1;
+	if (cache_worse(b, a))
+		return -1;
+	return 0;
+}
+
+static void heap_sift_down(struct cache_entry *h, size_t num, size_t i)
+{
+	for (;;) {
+		size_t worst = i, c = i * 2 + 1;
+		struct cache_entry tmp;
+
+		if (c < num && cache_worse(&h[c], &h[worst]))
+			worst = c;
+		if (c + 1 < num && cache_worse(&h[c+1], &h[worst]))
+			worst = c + 1;
+		if (worst == i)
+			return;
+		tmp = h[i];
+		h[i] = h[worst];
+		h[worst] = tmp;
+		i = worst;
+	}
+}
+
+static void heap_push(struct cache_entry *h, size_t *num,
+		      const struct cache_entry *e)
+{
+	size_t i = (*num)++;
+
+	while (i && cache_worse(e, &h[(i-1)/2])) {
+		h[i] = h[(i-1)/2];
+		i = (i-1)/2;
+	}
+	h[i] = *e;
+}
+
+static size_t cache_hash(size_t blocknum)
+{
+	/* Multiplying by an odd number permutes the low bits. */
+	return (blocknum * 0x9E3779B97F4A7C15ULL) & (CACHE_HASH_SIZE - 1);
+}
+
+static struct cache_slot *cache_slot(const struct cache *cache,
+				     size_t blocknum)
+{
+	size_t i;
+
+	for (i = cache_hash(blocknum);
+	     cache->slot[i].blocknum;
+	     i = (i + 1) & (CACHE_HASH_SIZE - 1)) {
+		if (cache->slot[i].blocknum == blocknum)
+			return (struct cache_slot *)&cache->slot[i];
+	}
+	return NULL;
+}
+
+static struct cache_slot *cache_slot_add(struct cache *cache, size_t blocknum)
+{
+	size_t i;
 
-	for (i = 0; cache[i].skip >= skip; i++)
-		assert(i < CACHE_SIZE);
+	for (i = cache_hash(blocknum);
+	     cache->slot[i].blocknum;
+	     i = (i + 1) & (CACHE_HASH_SIZE - 1));
+	cache->slot[i].blocknum = blocknum;
+	return &cache->slot[i];
+}
 
-	memmove(cache + i + 1, cache + i, sizeof(*cache) * (CACHE_SIZE - i - 1));
-	cache[i].skip = skip;
-	cache[i].blocknum = blocknum;
+/* Linear probing: shuffle back later entries which can fill the hole. */
+static void cache_slot_del(struct cache *cache, struct cache_slot *slot)
+{
+	size_t hole = slot - cache->slot, i = hole;
+
+	for (;;) {
+		size_t home;
+
+		i = (i + 1) & (CACHE_HASH_SIZE - 1);
+		if (!cache->slot[i].blocknum)
+			break;
+		home = cache_hash(cache->slot[i].blocknum);
+		if (hole < i ? (home <= hole || home > i)
+		    : (home <= hole && home > i)) {
+			cache->slot[hole] = cache->slot[i];
+			hole = i;
+		}
+	}
+	cache->slot[hole].blocknum = 0;
 }
 
-/* FIXME: Store the huff depth in cache, and recalc only when cache changes */
 struct huff_info {
 	size_t total_skips;
-	size_t depth_of_node;
+	/* Depth of empty (blocknum 0) entries under here, or -1. */
+	size_t depth_of_empty;
 };
 
-static void insert_huff(struct huff_info *info, size_t cachesize,
-			const struct huff_info *comb)
+/* Leaves are taken from the end, combined nodes come out in
+ * non-decreasing order so they form a second queue.  On equal skips,
+ * leaves go first, then older combined nodes: the same order as
+ * re-inserting each combined node into the sorted list would give. */
+static size_t huff_pick(const struct huff_info *info, size_t *leaf,
+			size_t *comb, size_t next)
 {
-	size_t i;
-
-	for (i = 0; info[i].total_skips > comb->total_skips; i++);
-	memmove(info + i + 1, info + i, sizeof(*info) * (cachesize - i - 1));
-	info[i] = *comb;
+	if (*comb == next
+	    || (*leaf && info[*leaf-1].total_skips <= info[*comb].total_skips))
+		return --*leaf;
+	return (*comb)++;
 }
 
-static size_t get_huffman_depth(const struct cache *c, size_t cachesize,
-				size_t blocknum)
+/* Huffman tree over the first cachesize entries (sorted best first),
+ * recording the depth of every entry in it. */
+static void huffman_depths(const struct cache_entry *e, size_t cachesize,
+			   unsigned int *depth, unsigned int *empty_depth)
 {
-	struct huff_info info[cachesize];
-	int i;
+	struct huff_info info[cachesize * 2];
+	size_t parent[cachesize * 2], node_depth[cachesize * 2];
+	size_t leaf = cachesize, comb = cachesize, next = cachesize, i;
 
 	for (i = 0; i < cachesize; i++) {
-		info[i].total_skips = c[i].skip;
-		if (c[i].blocknum == blocknum)
-			info[i].depth_of_node = 0;
+		info[i].total_skips = e[i].skip;
+		if (e[i].blocknum == 0)
+			info[i].depth_of_empty = 0;
 		else
-			info[i].depth_of_node = -1;
-	}
-
-	/* We always keep cache in largest->smallest order, so
-	 * just grab last two and combine them. */
-	while (cachesize > 1) {
-		struct huff_info comb;
-		comb.total_skips = info[cachesize-1].total_skips
-			+ info[cachesize-2].total_skips;
-		if (info[cachesize-1].depth_of_node == -1) {
-			if (info[cachesize-2].depth_of_node == -1) {
-				comb.depth_of_node = -1;
+			info[i].depth_of_empty = -1;
+	}
+
+	while (leaf + next - comb > 1) {
+		size_t a = huff_pick(info, &leaf, &comb, next);
+		size_t b = huff_pick(info, &leaf, &comb, next);
+
+		info[next].total_skips = info[a].total_skips
+			+ info[b].total_skips;
+		if (info[a].depth_of_empty == -1) {
+			if (info[b].depth_of_empty == -1) {
+				info[next].depth_of_empty = -1;
 			} else
-				comb.depth_of_node = 1 + info[cachesize-2].depth_of_node;
+				info[next].depth_of_empty = 1 + info[b].depth_of_empty;
 		} else
-			comb.depth_of_node = 1 + info[cachesize-1].depth_of_node;
+			info[next].depth_of_empty = 1 + info[a].depth_of_empty;
+		parent[a] = parent[b] = next++;
+	}
 
-		insert_huff(info, cachesize, &comb);
-		cachesize--;
+	/* Parents always come after children. */
+	node_depth[next-1] = 0;
+	for (i = next - 1; i-- > 0;)
+		node_depth[i] = node_depth[parent[i]] + 1;
+
+	for (i = 0; i < cachesize; i++)
+		depth[i] = node_depth[i];
+	*empty_depth = info[next-1].depth_of_empty;
+}
+
+/* Recalculate huffman depths for the best HUFF_SIZE. */
+static void calc_huffman_depths(struct cache *cache)
+{
+	struct cache_entry sorted[HUFF_SIZE];
+	unsigned int depth_small[HUFF_SMALL], depth[HUFF_SIZE];
+	size_t t, i, n = 0;
+
+	for (t = 0; t < CACHE_TIERS && cache_tier_end[t] <= HUFF_SIZE; t++) {
+		memcpy(sorted + n, cache->e + cache_tier_start(t),
+		       sizeof(sorted[0]) * cache->num[t]);
+		n += cache->num[t];
+	}
+	qsort(sorted, n, sizeof(sorted[0]), cache_entry_cmp);
+	for (i = n; i < HUFF_SIZE; i++)
+		sorted[i].blocknum = sorted[i].skip = 0;
+
+	huffman_depths(sorted, HUFF_SMALL, depth_small,
+		       &cache->empty_huffdepth_small);
+	huffman_depths(sorted, HUFF_SIZE, depth, &cache->empty_huffdepth);
+
+	for (i = 0; i < n; i++) {
+		struct cache_slot *slot = cache_slot(cache, sorted[i].blocknum);
+		slot->huffdepth = depth[i];
+		if (i < HUFF_SMALL)
+			slot->huffdepth_small = depth_small[i];
 	}
+}
 
-	return info[0].depth_of_node;
+static void init_cache(struct cache *cache)
+{
+	BUILD_ASSERT(CACHE_SIZE >= HUFF_SIZE);
+	BUILD_ASSERT((CACHE_SIZE & (CACHE_SIZE - 1)) == 0);
+
+	memset(cache, 0, sizeof(*cache));
+	calc_huffman_depths(cache);
+}
+
+static void add_to_cache(struct cache *cache,
+			 size_t skip, size_t blocknum)
+{
+	struct cache_entry e = { blocknum, skip };
+	size_t t, added = CACHE_TIERS;
+
+	/* Find the first tier with room, or whose worst we beat: the one
+	 * it pushes out cascades into the next tier. */
+	for (t = 0; t < CACHE_TIERS; t++) {
+		struct cache_entry *h = cache->e + cache_tier_start(t);
+		size_t max = cache_tier_end[t] - cache_tier_start(t);
+		struct cache_entry evicted;
+		bool room = (cache->num[t] < max);
+
+		if (room)
+			heap_push(h, &cache->num[t], &e);
+		else if (max && cache_worse(&h[0], &e)) {
+			evicted = h[0];
+			h[0] = e;
+			heap_sift_down(h, cache->num[t], 0);
+		} else
+			continue;
+
+		/* The first one we place is the new entry. */
+		if (added == CACHE_TIERS) {
+			added = t;
+			cache_slot_add(cache, e.blocknum)->tier = t;
+		} else
+			cache_slot(cache, e.blocknum)->tier = t;
+
+		if (room)
+			break;
+		e = evicted;
+	}
+
+	if (added == CACHE_TIERS)
+		return;
+
+	/* Fell out the bottom? */
+	if (t == CACHE_TIERS)
+		cache_slot_del(cache, cache_slot(cache, e.blocknum));
+
+	if (cache_tier_end[added] <= HUFF_SIZE)
+		calc_huffman_depths(cache);
+}
+
+/* Is blocknum in the best cachesize?  If so, and huffdepth, set that. */
+static bool cache_find(const struct cache *cache, size_t blocknum,
+		       size_t cachesize, size_t *huffdepth)
+{
+	const struct cache_slot *slot;
+	size_t t, num = 0;
+
+	/* Unfilled entries are blocknum 0 */
+	if (blocknum == 0) {
+		for (t = 0; t < CACHE_TIERS; t++)
+			num += cache->num[t];
+		if (num >= cachesize)
+			return false;
+		if (huffdepth)
+			*huffdepth = (cachesize == HUFF_SMALL
+				      ? cache->empty_huffdepth_small
+				      : cache->empty_huffdepth);
+		return true;
+	}
+
+	slot = cache_slot(cache, blocknum);
+	if (!slot || cache_tier_end[slot->tier] > cachesize)
+		return false;
+	if (huffdepth)
+		*huffdepth = (cachesize == HUFF_SMALL
+			      ? slot->huffdepth_small : slot->huffdepth);
+	return true;
 }
 
 /*
@@ -320,7 +642,7 @@ static size_t get_huffman_depth(const struct cache *c, size_t cachesize,
 static size_t mmr_cache_proof_len(size_t from, size_t to, const struct cache *c,
 				  size_t cachesize, bool huffman)
 {
-	int i;
+	size_t huffdepth;
 
 	assert(cachesize <= CACHE_SIZE);
 
@@ -329,14 +651,12 @@ static size_t mmr_cache_proof_len(size_t from, size_t to, const struct cache *c,
 		return mmr_proof_len(from, to, c, NULL);
 
 	/* If it's in the cache, use that. */
-	for (i = 0; i < cachesize; i++) {
-		if (c[i].blocknum == to) {
-			/* Simple cache structure is a tree. */
-			if (!huffman)
-				return 1 + ilog32(cachesize);
-			/* huffman encoding FTW. */
-			return 1 + get_huffman_depth(c, cachesize, to);
-		}
+	if (cache_find(c, to, cachesize, huffman ? &huffdepth : NULL)) {
+		/* Simple cache structure is a tree. */
+		if (!huffman)
+			return 1 + ilog32(cachesize);
+		/* huffman encoding FTW. */
+		return 1 + huffdepth;
 	}
 
 	return 1 + mmr_proof_len(from, to, c, NULL);
@@ -344,43 +664,43 @@ static size_t mmr_cache_proof_len(size_t from, size_t to, const struct cache *c,
 
 static size_t mmr_cache64_proof_len(size_t from, size_t to,
 				    const struct cache *c,
-				    const int *step)
+				    const size_t *step)
 {
 	return mmr_cache_proof_len(from, to, c, 64, false);
 }
 
 static size_t mmr_cache32_proof_len(size_t from, size_t to,
 				    const struct cache *c,
-				    const int *step)
+				    const size_t *step)
 {
 	return mmr_cache_proof_len(from, to, c, 32, false);
 }
 
 static size_t mmr_cache16_proof_len(size_t from, size_t to,
 				    const struct cache *c,
-				    const int *step)
+				    const size_t *step)
 {
 	return mmr_cache_proof_len(from, to, c, 16, false);
 }
 
 static size_t mmr_cachehuff32_proof_len(size_t from, size_t to,
 					const struct cache *c,
-					const int *step)
+					const size_t *step)
 {
-	return mmr_cache_proof_len(from, to, c, 32, true);
+	return mmr_cache_proof_len(from, to, c, HUFF_SMALL, true);
 }
 
 static size_t mmr_cachehuff64_proof_len(size_t from, size_t to,
 					const struct cache *c,
-					const int *step)
+					const size_t *step)
 {
-	return mmr_cache_proof_len(from, to, c, 64, true);
+	return mmr_cache_proof_len(from, to, c, HUFF_SIZE, true);
 }
 
 /* Each block has a cache of steps *prev* found useful. */
 static size_t mmr_prevsteps_proof_len(size_t from, size_t to,
 				      const struct cache *c,
-				      const int *step)
+				      const size_t *step)
 {
 	size_t i, n, found = -1;
 
@@ -397,127 +717,974 @@ static size_t mmr_prevsteps_proof_len(size_t from, size_t to,
 struct style {
 	const char *name;
 	size_t (*proof_len)(size_t, size_t, const struct cache *,
-			    const int *step);
+			    const size_t *step);
+	/* If non-NULL, lowest 'to' for which proof_len only depends
+	 * on ilog(from - to) (print_optimal_length uses that). */
+	size_t (*band_floor)(size_t from);
+	/* If non-NULL, fills out[] with proof_len for all of [lo, hi]. */
+	void (*proof_lens)(size_t from, size_t lo, size_t hi,
+			   const struct cache *, const size_t *step,
+			   unsigned int *out);
+	/* Needs step[] all the way back (so can't use --max-skip). */
+	bool history;
 };
 
 struct style styles[] = {
-	{ "rfc6862", rfc6962_proof_len },
-	{ "optimal", optimal_proof_len },
-	{ "breadth-batch", breadth_batch_proof_len },
+	{ "rfc6862", rfc6962_proof_len, NULL, rfc6962_proof_lens },
+	{ "optimal", optimal_proof_len, optimal_band_floor, optimal_proof_lens },
+	{ "breadth-batch", breadth_batch_proof_len, breadth_batch_band_floor },
 	{ "rfc6962-batch", rfc6962_batch_proof_len },
-	{ "mmr", mmr_proof_len },
-	{ "mmr-linear", mmr_linear_proof_len },
+	{ "mmr", mmr_proof_len, NULL, mmr_proof_lens },
+	{ "mmr-linear", mmr_linear_proof_len, NULL, mmr_linear_proof_lens },
 	{ "mmr-cache-sixtyfour", mmr_cache64_proof_len },
 	{ "mmr-cache-thirtytwo", mmr_cache32_proof_len },
 	{ "mmr-cache-sixteen", mmr_cache16_proof_len },
 	{ "mmr-cachehuff-sixtyfour", mmr_cachehuff64_proof_len },
 	{ "mmr-cachehuff-thirtytwo", mmr_cachehuff32_proof_len },
-	{ "mmr-prevsteps", mmr_prevsteps_proof_len }
+	{ "mmr-prevsteps", mmr_prevsteps_proof_len, NULL, NULL, true }
+};
+
+/* Segment tree for range-minimum over an array we fill in as we go. */
+struct rmq {
+	size_t size;
+	unsigned int *min;
 };
 
-static void print_proof_lengths(size_t num, size_t target, size_t seed)
+static void rmq_init(struct rmq *rmq, size_t num)
+{
+	for (rmq->size = 1; rmq->size < num; rmq->size *= 2);
+	/* Each update or query touches a node on every level. */
+	rmq->min = big_alloc(rmq->size * 2, sizeof(*rmq->min), BIG_RANDOM);
+}
+
+static void rmq_free(struct rmq *rmq)
+{
+	big_free(rmq->min, rmq->size * 2, sizeof(*rmq->min));
+}
+
+static void rmq_set(struct rmq *rmq, size_t i, unsigned int val)
+{
+	i += rmq->size;
+	rmq->min[i] = val;
+	for (i /= 2; i; i /= 2) {
+		unsigned int l = rmq->min[i*2], r = rmq->min[i*2+1];
+		rmq->min[i] = l < r ? l : r;
+	}
+}
+
+/* Smallest value in [lo, hi]. */
+static unsigned int rmq_min(const struct rmq *rmq, size_t lo, size_t hi)
 {
-	int *dist, *step;
-	struct cache cache[CACHE_SIZE];
+	unsigned int min = -1;
+
+	for (lo += rmq->size, hi += rmq->size + 1; lo < hi; lo /= 2, hi /= 2) {
+		if ((lo & 1) && rmq->min[lo] < min)
+			min = rmq->min[lo];
+		lo += (lo & 1);
+		if ((hi & 1) && rmq->min[hi-1] < min)
+			min = rmq->min[hi-1];
+	}
+	return min;
+}
+
+static long do_rmq_rightmost(const struct rmq *rmq, size_t node,
+			     size_t nlo, size_t nhi,
+			     size_t lo, size_t hi, unsigned int max)
+{
+	size_t mid;
+	long ret;
+
+	if (nhi < lo || nlo > hi || rmq->min[node] > max)
+		return -1;
+	if (nlo == nhi)
+		return nlo;
+
+	mid = nlo + (nhi - nlo) / 2;
+	ret = do_rmq_rightmost(rmq, node*2+1, mid+1, nhi, lo, hi, max);
+	if (ret == -1)
+		ret = do_rmq_rightmost(rmq, node*2, nlo, mid, lo, hi, max);
+	return ret;
+}
+
+/* Largest index in [lo, hi] whose value is <= max, or -1. */
+static long rmq_rightmost(const struct rmq *rmq, size_t lo, size_t hi,
+			  unsigned int max)
+{
+	if (lo > hi)
+		return -1;
+	return do_rmq_rightmost(rmq, 1, 0, rmq->size - 1, lo, hi, max);
+}
+
+/* How to generate and scan the chain: the same for every run. */
+struct chain_opts {
+	enum blockrng_kind rngkind;
+	/* Draw blocks on a producer thread? */
+	bool pipeline;
+	/* Helpers for huge skips, or NULL. */
+	struct parmin_pool *pool;
+};
+
+static void print_proof_lengths(size_t num, size_t target, size_t seed,
+				const struct chain_opts *opts)
+{
+	unsigned int *dist;
+	size_t *step;
+	struct cache cache;
 	size_t i, s, plen;
-	struct isaac64_ctx isaac;
+	struct blockrng rng;
+	struct blockpipe pipe;
+	struct rmq rmq;
 
-	isaac64_init(&isaac, (void *)&seed, sizeof(seed));
+	blockrng_init(&rng, opts->rngkind, seed, target+1);
+	blockpipe_start(&pipe, &rng, num, opts->pipeline);
 
-	dist = calloc(sizeof(*dist), num);
-	step = calloc(sizeof(*step), num);
-	init_cache(cache);
+	dist = big_alloc(num, sizeof(*dist), BIG_SEQUENTIAL);
+	step = big_alloc(num, sizeof(*step), BIG_SEQUENTIAL);
+	rmq_init(&rmq, num);
+	init_cache(&cache);
 	for (i = target+1; i < num; i++) {
 		/* We can skip more if we're better than required. */
-		uint64_t skip = -1ULL / isaac64_next_uint64(&isaac);
-		int j, best;
+		uint64_t skip = blockpipe_next(&pipe).skip;
+		long j;
+		size_t best;
 
 		if (skip > i)
 			skip = i;
-		add_to_cache(cache, skip, i);
+		add_to_cache(&cache, skip, i);
 
+		/* Scanning down from i-1, we switch best whenever we find
+		 * one at least 2 better: so find each of those directly. */
 		best = i-1;
-		for (j = i-1; j >= (int)(i-skip); j--)
-			if (1 + dist[j] < dist[best])
-				best = j;
+		while (dist[best] >= 2) {
+			j = rmq_rightmost(&rmq, i-skip, best-1, dist[best] - 2);
+			if (j == -1)
+				break;
+			best = j;
+		}
 		dist[i] = dist[best] + 1;
 		step[i] = best;
+		rmq_set(&rmq, i, dist[i]);
 	}
+	blockpipe_stop(&pipe);
 
 #if 0
 	printf("CPV path (len %u):\n", dist[num-1]);
 	for (i = num-1; i != target; i = step[i])
-		printf("-> %u (-%zu)\n", step[i], i - step[i]);
+		printf("-> %zu (-%zu)\n", step[i], i - step[i]);
 #endif
 
 	for (s = 0; s < ARRAY_SIZE(styles); s++) {
 		plen = 0;
 		for (i = num-1; i != target; i = step[i])
-			plen += styles[s].proof_len(i, step[i], cache, step);
+			plen += styles[s].proof_len(i, step[i], &cache, step);
 		printf("%s: proof hashes %zu\n", styles[s].name, plen);
 	}
 
+	rmq_free(&rmq);
+	big_free(dist, num, sizeof(*dist));
+	big_free(step, num, sizeof(*step));
+}
+
+/* With --max-skip we only ever look back max_skip blocks, so we only
+ * need a ring of that many: ring_mask() gives the index mask. */
+static size_t ring_mask(size_t max_skip)
+{
+	size_t size;
+
+	for (size = 1; size < max_skip + 1; size *= 2);
+	return size - 1;
+}
+
+/* Streaming version of print_proof_lengths: without all the steps we
+ * can't cost the path in each style, so just report its length. */
+static void print_windowed_path(size_t num, size_t target, size_t seed,
+				const struct chain_opts *opts,
+				size_t max_skip)
+{
+	size_t mask = ring_mask(max_skip), i;
+	unsigned int *dist;
+	struct blockrng rng;
+	struct blockpipe pipe;
+
+	blockrng_init(&rng, opts->rngkind, seed, target+1);
+	blockpipe_start(&pipe, &rng, num, opts->pipeline);
+
+	dist = calloc(sizeof(*dist), mask + 1);
+	for (i = target+1; i < num; i++) {
+		/* We can skip more if we're better than required. */
+		uint64_t skip = blockpipe_next(&pipe).skip;
+		size_t j, best;
+
+		if (skip > i)
+			skip = i;
+		if (skip > max_skip)
+			skip = max_skip;
+
+		best = i-1;
+		for (j = i-1; j + skip >= i; j--) {
+			if (1 + dist[j & mask] < dist[best & mask])
+				best = j;
+			if (j == 0)
+				break;
+		}
+		dist[i & mask] = dist[best & mask] + 1;
+	}
+	blockpipe_stop(&pipe);
+
+	printf("path: length %u\n", dist[(num-1) & mask]);
 	free(dist);
-	free(step);
 }
 
-/* Calculate the optimal proof lengths for all variants at once. */
-struct prooflen {
-	unsigned int len[ARRAY_SIZE(styles)];
+/* Every 'to' in a power-of-two band of distance costs the same, so we
+ * only need the best prooflen in each band: [lo, from-1] takes
+ * O(log(from - lo)) range-minimum queries.  Like the linear scan,
+ * ties go to the highest 'to'. */
+static void optimal_banded(const struct style *style, const struct rmq *rmq,
+			   size_t from, size_t lo,
+			   const struct cache *cache, const size_t *step,
+			   unsigned int *len, size_t *beststep)
+{
+	size_t dlo;
+
+	for (dlo = 1; dlo <= from - lo; dlo *= 2) {
+		size_t jhi = from - dlo, jlo, cost;
+		unsigned int min;
+
+		if (dlo * 2 - 1 > from - lo)
+			jlo = lo;
+		else
+			jlo = from - (dlo * 2 - 1);
+
+		min = rmq_min(rmq, jlo, jhi);
+		cost = style->proof_len(from, jhi, cache, step);
+		if (cost + min < *len) {
+			*len = cost + min;
+			*beststep = rmq_rightmost(rmq, jlo, jhi, min);
+		}
+	}
+}
+
+/* Smallest cost[k] + len[k] for k in [0, n), highest k on ties.  Both
+ * loops vectorize; we build AVX2 and SSE4.1 versions (for unsigned
+ * min) and pick at runtime. */
+__attribute__((target_clones("avx2", "sse4.1", "default")))
+static unsigned int min_plus(const unsigned int *cost, const unsigned int *len,
+			     size_t n, size_t *best)
+{
+	unsigned int min = -1;
+	size_t k;
+
+	for (k = 0; k < n; k++) {
+		unsigned int v = cost[k] + len[k];
+		min = v < min ? v : min;
+	}
+	for (k = n; k-- > 0;)
+		if (cost[k] + len[k] == min)
+			break;
+	*best = k;
+	return min;
+}
+
+/* Cost whole batches of [lo, hi] at once, from the top down so
+ * ties still go to the highest 'to'. */
+#define BATCH_SIZE 1024
+static void optimal_batch(const struct style *style,
+			  const unsigned int *prooflen,
+			  size_t from, size_t lo, size_t hi,
+			  const struct cache *cache, const size_t *step,
+			  unsigned int *len, size_t *beststep)
+{
+	unsigned int cost[BATCH_SIZE];
+
+	for (;;) {
+		size_t start, best;
+		unsigned int min;
+
+		if (hi - lo >= BATCH_SIZE)
+			start = hi - BATCH_SIZE + 1;
+		else
+			start = lo;
+
+		style->proof_lens(from, start, hi, cache, step, cost);
+		min = min_plus(cost, prooflen + start, hi - start + 1, &best);
+		if (min < *len) {
+			*len = min;
+			*beststep = start + best;
+		}
+		if (start == lo)
+			break;
+		hi = start - 1;
+	}
+}
+
+/* One style's scan back from block 'from', for parmin. */
+struct style_scan {
+	const struct style *style;
+	const unsigned int *len;
+	size_t mask, from;
+	const struct cache *cache;
+	const size_t *step;
 };
 
-/* This sorts by actual (optimal) proof len, not path len  */
-static void print_optimal_length(size_t num, size_t target, size_t seed)
+static void batch_scan(size_t lo, size_t hi, void *arg,
+		       unsigned int *min, size_t *minj)
+{
+	const struct style_scan *sc = arg;
+
+	optimal_batch(sc->style, sc->len, sc->from, lo, hi,
+		      sc->cache, sc->step, min, minj);
+}
+
+static void linear_scan(size_t lo, size_t hi, void *arg,
+			unsigned int *min, size_t *minj)
 {
-	struct prooflen *prooflen;
-	struct cache cache[CACHE_SIZE];
-	size_t i, s;
-	struct isaac64_ctx isaac;
-	int *step[ARRAY_SIZE(styles)];
+	const struct style_scan *sc = arg;
+	size_t j;
+
+	for (j = hi; j + 1 > lo; j--) {
+		size_t plen = sc->style->proof_len(sc->from, j, sc->cache,
+						   sc->step);
+		if (plen + sc->len[j & sc->mask] < *min) {
+			*min = plen + sc->len[j & sc->mask];
+			*minj = j;
+		}
+	}
+}
 
-	isaac64_init(&isaac, (void *)&seed, sizeof(seed));
+/* Everything the DP workers share.  We calculate the optimal proof
+ * lengths for all variants at once: each style has its own column of
+ * lengths and steps (cache-line aligned, from big_alloc), so the DP
+ * for one style walks contiguous memory. */
+struct optimal_run {
+	unsigned int *prooflen[ARRAY_SIZE(styles)];
+	size_t *step[ARRAY_SIZE(styles)];
+	struct rmq rmq[ARRAY_SIZE(styles)];
+	size_t num, target, seed, max_skip;
+	const struct chain_opts *opts;
+	/* Styles we're calculating, and column length (a ring if max_skip) */
+	size_t which[ARRAY_SIZE(styles)], nwhich, ncol;
+	/* Block to start at, and the chain state there. */
+	size_t start;
+	struct blockrng rng;
+	struct cache cache;
+	/* If non-NULL, write there every checkpoint_every blocks. */
+	const char *checkpoint;
+	size_t checkpoint_every;
+	/* Its data file (or -1), which has whole columns up to cols_done. */
+	int cols_fd;
+	size_t cols_done;
+	pthread_barrier_t barrier;
+};
 
-	prooflen = calloc(sizeof(*prooflen), num);
-	for (s = 0; s < ARRAY_SIZE(styles); s++)
-		step[s] = calloc(sizeof(*step[s]), num);
-	init_cache(cache);
+/* Checkpoint is this, then blockrng, cache, and the rings if
+ * max_skip.  Whole columns go in its data file instead. */
+#define OPTIMAL_CHECKPOINT_MAGIC "ttopt004"
+struct optimal_checkpoint {
+	uint64_t num, target, seed, max_skip, rngkind;
+	/* Bitmap of styles. */
+	uint64_t styles;
+	/* Next block to calculate. */
+	uint64_t next;
+};
 
-	for (i = target+1; i < num; i++) {
+static void optimal_checkpoint_header(const struct optimal_run *run,
+				      struct optimal_checkpoint *hdr)
+{
+	size_t w;
+
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->num = run->num;
+	hdr->target = run->target;
+	hdr->seed = run->seed;
+	hdr->max_skip = run->max_skip;
+	hdr->rngkind = run->opts->rngkind;
+	for (w = 0; w < run->nwhich; w++)
+		hdr->styles |= (uint64_t)1 << run->which[w];
+}
+
+static off_t column_io(int fd, void *col, size_t size, size_t num,
+		       size_t from, size_t to, off_t off, bool save)
+{
+	char *p = (char *)col + size * from;
+
+	if (save)
+		checkpoint_data_write(fd, p, size * (to - from),
+				      off + size * from);
+	else
+		checkpoint_data_read(fd, p, size * (to - from),
+				     off + size * from);
+	return off + (off_t)size * num;
+}
+
+/* Whole columns sit num long at fixed offsets in the data file, so a
+ * checkpoint only has to write blocks from..to-1: rewriting them all
+ * each time is quadratic.  Steps are only ever read by history styles,
+ * so we don't bother saving the others. */
+static void checkpoint_columns(const struct optimal_run *run, int fd,
+			       size_t from, size_t to, bool save)
+{
+	off_t off = 0;
+	size_t w;
+
+	for (w = 0; w < run->nwhich; w++) {
+		size_t s = run->which[w];
+
+		off = column_io(fd, run->prooflen[s],
+				sizeof(run->prooflen[s][0]), run->num,
+				from, to, off, save);
+		if (styles[s].history)
+			off = column_io(fd, run->step[s],
+					sizeof(run->step[s][0]), run->num,
+					from, to, off, save);
+	}
+}
+
+/* Rings are small, so they just go in the checkpoint itself. */
+static void checkpoint_rings(const struct optimal_run *run, FILE *f,
+			     bool save)
+{
+	size_t w;
+
+	for (w = 0; w < run->nwhich; w++) {
+		size_t s = run->which[w];
+		size_t len = sizeof(run->prooflen[s][0]) * run->ncol;
+
+		if (save)
+			checkpoint_write(f, run->prooflen[s], len);
+		else
+			checkpoint_read(f, run->prooflen[s], len);
+		if (!styles[s].history)
+			continue;
+		len = sizeof(run->step[s][0]) * run->ncol;
+		if (save)
+			checkpoint_write(f, run->step[s], len);
+		else
+			checkpoint_read(f, run->step[s], len);
+	}
+}
+
+static void write_optimal_checkpoint(struct optimal_run *run,
+				     size_t next,
+				     const struct blockrng *rng,
+				     const struct cache *cache)
+{
+	struct optimal_checkpoint hdr;
+	FILE *f;
+
+	/* The checkpoint only vouches for columns up to next, so get
+	 * them down before committing it. */
+	if (!run->max_skip) {
+		if (run->cols_fd < 0)
+			run->cols_fd = checkpoint_data_open(run->checkpoint,
+							    run->cols_done == 0);
+		checkpoint_columns(run, run->cols_fd, run->cols_done, next,
+				   true);
+		checkpoint_data_sync(run->cols_fd);
+		run->cols_done = next;
+	}
+
+	optimal_checkpoint_header(run, &hdr);
+	hdr.next = next;
+
+	f = checkpoint_create(run->checkpoint, OPTIMAL_CHECKPOINT_MAGIC);
+	checkpoint_write(f, &hdr, sizeof(hdr));
+	checkpoint_write(f, rng, sizeof(*rng));
+	checkpoint_write(f, cache, sizeof(*cache));
+	if (run->max_skip)
+		checkpoint_rings(run, f, true);
+	checkpoint_commit(f, run->checkpoint);
+}
+
+/* Open file, exiting unless it's a checkpoint of this run; it's left
+ * just past the header, and *next is the block to carry on from. */
+static FILE *open_optimal_checkpoint(const struct optimal_run *run,
+				     const char *file, size_t *next)
+{
+	struct optimal_checkpoint hdr, expect;
+	FILE *f;
+
+	f = checkpoint_open(file, OPTIMAL_CHECKPOINT_MAGIC);
+	checkpoint_read(f, &hdr, sizeof(hdr));
+	optimal_checkpoint_header(run, &expect);
+	expect.next = hdr.next;
+	if (memcmp(&hdr, &expect, sizeof(hdr)) != 0)
+		errx(1, "%s: different num, target, seed, rng, max-skip or styles",
+		     file);
+	if (hdr.next <= run->target || hdr.next > run->num)
+		errx(1, "%s: bad next block %"PRIu64, file, hdr.next);
+	*next = hdr.next;
+	return f;
+}
+
+static void read_optimal_checkpoint(struct optimal_run *run, const char *file)
+{
+	size_t w, j;
+	FILE *f;
+	int fd;
+
+	f = open_optimal_checkpoint(run, file, &run->start);
+	checkpoint_read(f, &run->rng, sizeof(run->rng));
+	checkpoint_read(f, &run->cache, sizeof(run->cache));
+	if (run->max_skip) {
+		checkpoint_rings(run, f, false);
+		fclose(f);
+		return;
+	}
+	fclose(f);
+
+	fd = checkpoint_data_open(file, false);
+	checkpoint_columns(run, fd, 0, run->start, false);
+	/* Checkpointing to the same file, we can just carry on from
+	 * here; anywhere else needs the columns writing out again. */
+	if (run->checkpoint && strcmp(run->checkpoint, file) == 0) {
+		run->cols_fd = fd;
+		run->cols_done = run->start;
+	} else
+		close(fd);
+
+	for (w = 0; w < run->nwhich; w++) {
+		size_t s = run->which[w];
+
+		if (!styles[s].band_floor)
+			continue;
+		for (j = 0; j < run->start; j++)
+			rmq_set(&run->rmq[s], j, run->prooflen[s][j]);
+	}
+}
+
+/* Don't draw blocks past the next checkpoint (at or after i), where
+ * we save the rng. */
+static size_t draw_limit(const struct optimal_run *run, size_t i)
+{
+	size_t every = run->checkpoint_every;
+
+	if (run->checkpoint && i + (every - i % every) % every + 1 < run->num)
+		return i + (every - i % every) % every + 1;
+	return run->num;
+}
+
+/* Run the DP for styles which[0...nwhich-1].  The styles are
+ * independent, but the cache styles need the luckiest cache, so each
+ * caller replays the chain itself. */
+static void optimal_styles(struct optimal_run *run,
+			   const size_t *which, size_t nwhich)
+{
+	unsigned int **prooflen = run->prooflen;
+	size_t **step = run->step;
+	struct rmq *rmq = run->rmq;
+	size_t num = run->num, max_skip = run->max_skip;
+	/* Columns are rings if max_skip (fast paths need them whole) */
+	size_t mask = max_skip ? ring_mask(max_skip) : SIZE_MAX;
+	struct cache cache = run->cache;
+	struct blockpipe pipe;
+	size_t i, w;
+
+	blockpipe_start(&pipe, &run->rng, draw_limit(run, run->start),
+			run->opts->pipeline);
+	for (i = run->start; i < num; i++) {
 		/* We can skip more if we're better than required. */
-		uint64_t skip = -1ULL / isaac64_next_uint64(&isaac);
-		int j;
+		uint64_t skip = blockpipe_next(&pipe).skip;
+		long j;
 
 		if (skip > i)
 			skip = i;
-		add_to_cache(cache, skip, i);
-
-		for (s = 0; s < ARRAY_SIZE(styles); s++) {
-			prooflen[i].len[s] = -1;
-			for (j = i-1; j >= (int)(i-skip); j--) {
-				size_t len = styles[s].proof_len(i, j, cache,
-								 step[s]);
-				if (len + prooflen[j].len[s]
-				    < prooflen[i].len[s]) {
-					prooflen[i].len[s]
-						= len + prooflen[j].len[s];
-					step[s][i] = j;
-				}
+		if (max_skip && skip > max_skip)
+			skip = max_skip;
+		add_to_cache(&cache, skip, i);
+
+		for (w = 0; w < nwhich; w++) {
+			size_t s = which[w];
+			unsigned int *len = prooflen[s];
+			bool banded = (!max_skip && styles[s].band_floor);
+			struct style_scan sc = { &styles[s], len, mask, i,
+						 &cache, step[s] };
+			unsigned int min = -1;
+			size_t best;
+
+			len[i & mask] = -1;
+			j = i-1;
+			if (banded) {
+				size_t floor = styles[s].band_floor(i);
+
+				if (floor < i-skip)
+					floor = i-skip;
+				if (floor < i)
+					optimal_banded(&styles[s], &rmq[s],
+						       i, floor, &cache, step[s],
+						       &len[i],
+						       &step[s][i]);
+				j = floor - 1;
+			} else if (!max_skip && styles[s].proof_lens) {
+				parmin(run->opts->pool, i-skip, i-1, batch_scan, &sc,
+				       &min, &best);
+				j = (long)(i-skip) - 1;
 			}
+			if (j >= (long)(i-skip))
+				parmin(run->opts->pool, i-skip, j, linear_scan, &sc,
+				       &min, &best);
+			/* Anything banded found was higher, so wins ties. */
+			if (min < len[i & mask]) {
+				len[i & mask] = min;
+				step[s][i & mask] = best;
+			}
+			if (banded)
+				rmq_set(&rmq[s], i, len[i]);
+		}
+
+		/* Every worker is at the same point in the chain, so wait
+		 * for them all, and have one write it out. */
+		if (run->checkpoint && i % run->checkpoint_every == 0
+		    && i + 1 < num) {
+			if (pthread_barrier_wait(&run->barrier)
+			    == PTHREAD_BARRIER_SERIAL_THREAD) {
+				struct blockrng rng;
+
+				blockpipe_rng(&pipe, &rng);
+				write_optimal_checkpoint(run, i + 1,
+							 &rng, &cache);
+			}
+			pthread_barrier_wait(&run->barrier);
+			blockpipe_limit(&pipe, draw_limit(run, i + 1));
 		}
 	}
+	blockpipe_stop(&pipe);
+}
+
+struct optimal_worker {
+	pthread_t thread;
+	struct optimal_run *run;
+	size_t which[ARRAY_SIZE(styles)], nwhich;
+};
+
+static void *optimal_worker(void *arg)
+{
+	struct optimal_worker *w = arg;
+
+	optimal_styles(w->run, w->which, w->nwhich);
+	return NULL;
+}
 
+/* Everything but the columns, so main can check a checkpoint fits
+ * without allocating them. */
+static void set_optimal_run(struct optimal_run *run, size_t num,
+			    size_t target, size_t seed,
+			    const struct chain_opts *opts, size_t max_skip,
+			    const bool *wanted)
+{
+	size_t s;
+
+	run->num = num;
+	run->target = target;
+	run->seed = seed;
+	run->opts = opts;
+	run->max_skip = max_skip;
+	run->ncol = max_skip ? ring_mask(max_skip) + 1 : num;
+	run->cols_fd = -1;
 	for (s = 0; s < ARRAY_SIZE(styles); s++) {
+		if (wanted[s])
+			run->which[run->nwhich++] = s;
+	}
+}
+
+/* Allocate columns for the wanted styles (main has already dropped
+ * history styles if max_skip). */
+static struct optimal_run *new_optimal_run(size_t num, size_t target,
+					   size_t seed,
+					   const struct chain_opts *opts,
+					   size_t max_skip,
+					   const bool *wanted)
+{
+	struct optimal_run *run = calloc(sizeof(*run), 1);
+	size_t w, s;
+
+	set_optimal_run(run, num, target, seed, opts, max_skip, wanted);
+	for (w = 0; w < run->nwhich; w++) {
+		s = run->which[w];
+		run->prooflen[s] = big_alloc(run->ncol,
+					     sizeof(*run->prooflen[s]),
+					     BIG_SEQUENTIAL);
+		run->step[s] = big_alloc(run->ncol, sizeof(*run->step[s]),
+					 BIG_SEQUENTIAL);
+		if (!max_skip && styles[s].band_floor)
+			rmq_init(&run->rmq[s], num);
+	}
+	return run;
+}
+
+/* Start again from target with this seed.  Whole columns are never
+ * written at or below target, so they can be reused as they are; rings
+ * wrap, so they have to be cleared. */
+static void reset_optimal_run(struct optimal_run *run, size_t seed)
+{
+	size_t w, s;
+
+	if (run->max_skip) {
+		for (w = 0; w < run->nwhich; w++) {
+			s = run->which[w];
+			memset(run->prooflen[s], 0,
+			       sizeof(*run->prooflen[s]) * run->ncol);
+			memset(run->step[s], 0,
+			       sizeof(*run->step[s]) * run->ncol);
+		}
+	}
+	run->seed = seed;
+	blockrng_init(&run->rng, run->opts->rngkind, seed, run->target + 1);
+	init_cache(&run->cache);
+	run->start = run->target + 1;
+}
+
+static unsigned int optimal_result(const struct optimal_run *run, size_t s)
+{
+	return run->prooflen[s][(run->num-1) % run->ncol];
+}
+
+static void free_optimal_run(struct optimal_run *run)
+{
+	size_t w, s;
+
+	for (w = 0; w < run->nwhich; w++) {
+		s = run->which[w];
+		big_free(run->prooflen[s], run->ncol, sizeof(*run->prooflen[s]));
+		big_free(run->step[s], run->ncol, sizeof(*run->step[s]));
+		if (!run->max_skip && styles[s].band_floor)
+			rmq_free(&run->rmq[s]);
+	}
+	if (run->cols_fd >= 0)
+		close(run->cols_fd);
+	free(run);
+}
+
+/* This sorts by actual (optimal) proof len, not path len  */
+static void print_optimal_length(size_t num, size_t target, size_t seed,
+				 const struct chain_opts *opts,
+				 size_t nthreads, size_t max_skip,
+				 const bool *wanted,
+				 const char *checkpoint,
+				 size_t checkpoint_every,
+				 const char *resume)
+{
+	struct optimal_run *run;
+	size_t s, w;
+
+	run = new_optimal_run(num, target, seed, opts, max_skip, wanted);
+	run->checkpoint = checkpoint;
+	run->checkpoint_every = checkpoint_every;
+
+	if (resume)
+		read_optimal_checkpoint(run, resume);
+	else
+		reset_optimal_run(run, seed);
+
+	if (nthreads > run->nwhich)
+		nthreads = run->nwhich;
+	if (nthreads < 1)
+		nthreads = 1;
+	pthread_barrier_init(&run->barrier, NULL, nthreads);
+
+	if (nthreads == 1)
+		optimal_styles(run, run->which, run->nwhich);
+	else {
+		struct optimal_worker worker[nthreads];
+		size_t t;
+
+		/* Deal styles out round-robin, so the slow cache styles
+		 * at the end get spread across workers. */
+		for (t = 0; t < nthreads; t++) {
+			worker[t].run = run;
+			worker[t].nwhich = 0;
+			for (w = t; w < run->nwhich; w += nthreads)
+				worker[t].which[worker[t].nwhich++]
+					= run->which[w];
+			if (pthread_create(&worker[t].thread, NULL,
+					   optimal_worker, &worker[t]) != 0)
+				err(1, "Creating thread %zu", t);
+		}
+		for (t = 0; t < nthreads; t++)
+			pthread_join(worker[t].thread, NULL);
+	}
+	pthread_barrier_destroy(&run->barrier);
+
+	for (w = 0; w < run->nwhich; w++) {
+		s = run->which[w];
 		printf("prooflen-%s: proof hashes %u\n", styles[s].name,
-		       prooflen[num-1].len[s]);
+		       optimal_result(run, s));
 	}
-	free(prooflen);
-	for (s = 0; s < ARRAY_SIZE(styles); s++)
-		free(step[s]);
+	free_optimal_run(run);
+}
+
+/* --seeds A..B: every seed in the range, spread over jobs. */
+struct seed_range {
+	size_t first, last;
+};
+
+struct seed_sweep {
+	size_t num, target, max_skip;
+	const struct chain_opts *opts;
+	const bool *wanted;
+	struct seed_range range;
+	/* Next seed to hand out, under lock. */
+	pthread_mutex_t lock;
+	size_t next;
+	/* results[(seed - first) * ARRAY_SIZE(styles) + style] */
+	unsigned int *results;
+};
+
+static void *seed_worker(void *arg)
+{
+	struct seed_sweep *sweep = arg;
+	struct optimal_run *run;
+	size_t seed, w, s;
+
+	/* One set of columns per worker, reused for each seed. */
+	run = new_optimal_run(sweep->num, sweep->target, 0, sweep->opts,
+			      sweep->max_skip, sweep->wanted);
+	for (;;) {
+		pthread_mutex_lock(&sweep->lock);
+		seed = sweep->next++;
+		pthread_mutex_unlock(&sweep->lock);
+		if (seed > sweep->range.last)
+			break;
+
+		reset_optimal_run(run, seed);
+		optimal_styles(run, run->which, run->nwhich);
+		for (w = 0; w < run->nwhich; w++) {
+			s = run->which[w];
+			sweep->results[(seed - sweep->range.first)
+				       * ARRAY_SIZE(styles) + s]
+				= optimal_result(run, s);
+		}
+	}
+	free_optimal_run(run);
+	return NULL;
+}
+
+static int uint_cmp(const void *va, const void *vb)
+{
+	unsigned int a = *(const unsigned int *)va, b = *(const unsigned int *)vb;
+
+	return a < b ? -1 : a > b;
+}
+
+/* Nearest-rank percentile of sorted vals: the smallest value with at
+ * least pct% of them at or below it. */
+static unsigned int percentile(const unsigned int *vals, size_t n,
+			       unsigned int pct)
+{
+	size_t rank = (pct * n + 99) / 100;
+
+	return vals[rank ? rank - 1 : 0];
+}
+
+static void print_seed_stats(size_t num, size_t target,
+			     const struct chain_opts *opts,
+			     size_t max_skip,
+			     const bool *wanted, struct seed_range range,
+			     size_t njobs)
+{
+	struct seed_sweep sweep;
+	size_t n = range.last - range.first + 1, s, i, t;
+	unsigned int *vals = malloc(sizeof(*vals) * n);
+
+	sweep.num = num;
+	sweep.target = target;
+	sweep.max_skip = max_skip;
+	sweep.opts = opts;
+	sweep.wanted = wanted;
+	sweep.range = range;
+	sweep.next = range.first;
+	sweep.results = calloc(sizeof(*sweep.results), n * ARRAY_SIZE(styles));
+	pthread_mutex_init(&sweep.lock, NULL);
+
+	if (njobs > n)
+		njobs = n;
+	if (njobs < 1)
+		njobs = 1;
+	if (njobs == 1)
+		seed_worker(&sweep);
+	else {
+		/* --jobs is up to the user: not on the stack. */
+		pthread_t *thread = malloc(sizeof(*thread) * njobs);
+
+		if (!thread)
+			errx(1, "Allocating %zu threads", njobs);
+		for (t = 0; t < njobs; t++)
+			if (pthread_create(&thread[t], NULL,
+					   seed_worker, &sweep) != 0)
+				err(1, "Creating thread %zu", t);
+		for (t = 0; t < njobs; t++)
+			pthread_join(thread[t], NULL);
+		free(thread);
+	}
+	pthread_mutex_destroy(&sweep.lock);
+
+	printf("seeds %zu..%zu (%zu runs)\n", range.first, range.last, n);
+	for (s = 0; s < ARRAY_SIZE(styles); s++) {
+		double sum = 0, sumsq = 0, mean;
+
+		if (!wanted[s])
+			continue;
+		for (i = 0; i < n; i++) {
+			vals[i] = sweep.results[i * ARRAY_SIZE(styles) + s];
+			sum += vals[i];
+		}
+		mean = sum / n;
+		for (i = 0; i < n; i++)
+			sumsq += (vals[i] - mean) * (vals[i] - mean);
+		qsort(vals, n, sizeof(*vals), uint_cmp);
+		printf("prooflen-%s: proof hashes mean %.2f stddev %.2f"
+		       " min %u p50 %u p90 %u p99 %u max %u\n",
+		       styles[s].name, mean, n > 1 ? sqrt(sumsq / (n - 1)) : 0.0,
+		       vals[0], percentile(vals, n, 50),
+		       percentile(vals, n, 90), percentile(vals, n, 99),
+		       vals[n-1]);
+	}
+	free(sweep.results);
+	free(vals);
+}
+
+static char *opt_set_seed_range(const char *arg, struct seed_range *range)
+{
+	const char *p;
+	char *end;
+
+	range->first = strtoul(arg, &end, 0);
+	if (end == arg || strncmp(end, "..", 2) != 0)
+		return opt_invalid_argument(arg);
+	p = end + 2;
+	range->last = strtoul(p, &end, 0);
+	if (end == p || *end || range->last < range->first)
+		return opt_invalid_argument(arg);
+	return NULL;
+}
+
+static char *opt_add_style(const char *arg, bool *wanted)
+{
+	size_t s;
+
+	for (s = 0; s < ARRAY_SIZE(styles); s++) {
+		if (strcmp(styles[s].name, arg) == 0) {
+			wanted[s] = true;
+			return NULL;
+		}
+	}
+	return opt_invalid_argument(arg);
 }
 
 int main(int argc, char *argv[])
 {
-	unsigned int num, seed = 0, target = 0;
+	unsigned int seed = 0, target = 0, nthreads = 1, max_skip = 0, njobs = 1;
+	/* Empty unless --seeds. */
+	struct seed_range seeds = { 1, 0 };
+	bool sweep;
+	unsigned long checkpoint_every = 1000000;
+	char *checkpoint = NULL, *resume = NULL, *backing_dir = NULL;
+	bool huge_pages = false;
+	struct chain_opts opts = { BLOCKRNG_ISAAC, false, NULL };
+	unsigned int scan_threads = 0;
+	size_t num;
+	bool wanted[ARRAY_SIZE(styles)] = { false }, any = false;
+	bool needs_whole[ARRAY_SIZE(styles)];
+	size_t s;
 
 	opt_register_noarg("--usage|--help|-h", opt_usage_and_exit,
 			   "<num>\n"
@@ -528,16 +1695,93 @@ int main(int argc, char *argv[])
 			 "Block number to terminate SPV proof at");
 	opt_register_arg("--seed", opt_set_uintval, opt_show_uintval, &seed,
 			 "Seed for deterministic RNG");
+	opt_register_arg("--rng", opt_set_blockrng, NULL, &opts.rngkind,
+			 "Block hash generator: isaac (default) or philox");
+	opt_register_noarg("--pipeline", opt_set_bool, &opts.pipeline,
+			   "Draw blocks on a separate producer thread");
+	opt_register_arg("--scan-threads", opt_set_uintval, opt_show_uintval,
+			 &scan_threads,
+			 "Extra threads to split scans of huge skips across");
+	opt_register_arg("--seeds", opt_set_seed_range, NULL, &seeds,
+			 "Only print optimal length statistics over seeds A..B");
+	opt_register_arg("--jobs", opt_set_uintval, opt_show_uintval, &njobs,
+			 "Threads to spread --seeds across");
+	opt_register_arg("--threads", opt_set_uintval, opt_show_uintval,
+			 &nthreads,
+			 "Threads to spread optimal styles across (not with --seeds)");
+	opt_register_arg("--max-skip", opt_set_uintval, opt_show_uintval,
+			 &max_skip, "Cap skips, keeping only that many blocks");
+	opt_register_arg("--checkpoint", opt_set_charp, NULL, &checkpoint,
+			 "File to save optimal length progress to");
+	opt_register_arg("--checkpoint-every", opt_set_ulongval,
+			 opt_show_ulongval, &checkpoint_every,
+			 "Blocks between checkpoints");
+	opt_register_arg("--resume", opt_set_charp, NULL, &resume,
+			 "Continue optimal lengths from this checkpoint");
+	opt_register_arg("--backing-file", opt_set_charp, NULL, &backing_dir,
+			 "Directory for disk-backed (sparse, mmap'd) arrays");
+	opt_register_noarg("--huge-pages", opt_set_bool, &huge_pages,
+			   "Ask for huge pages for the big arrays");
+	opt_register_arg("--style", opt_add_style, NULL, wanted,
+			 "Only calculate optimal length for this style (can repeat)");
 
 	opt_parse(&argc, argv, opt_log_stderr_exit);
 	if (argc != 2)
 		opt_usage_and_exit(NULL);
 
-	num = atoi(argv[1]);
+	bigalloc_setup(backing_dir, huge_pages);
+	num = atol(argv[1]);
 	if (target >= num)
 		errx(1, "Don't do that, you'll crash me");
-	print_proof_lengths(num, target, seed);
-	print_optimal_length(num, target, seed);
+	if (checkpoint_every == 0)
+		errx(1, "--checkpoint-every must be non-zero");
+	sweep = (seeds.first <= seeds.last);
+	if (sweep && (checkpoint || resume))
+		errx(1, "--seeds doesn't do --checkpoint or --resume");
+	if (sweep && nthreads != 1)
+		errx(1, "--seeds spreads seeds with --jobs, not --threads");
+	/* Can't skip further back than genesis anyway. */
+	if (max_skip >= num)
+		max_skip = num - 1;
+	/* Default is all of them. */
+	for (s = 0; s < ARRAY_SIZE(styles); s++)
+		any |= wanted[s];
+	for (s = 0; s < ARRAY_SIZE(styles); s++) {
+		wanted[s] |= !any;
+		needs_whole[s] = wanted[s] && max_skip && styles[s].history;
+		wanted[s] &= !needs_whole[s];
+	}
+	/* Don't print anything for a checkpoint of some other run. */
+	if (resume) {
+		struct optimal_run probe = { 0 };
+		size_t next;
+
+		set_optimal_run(&probe, num, target, seed, &opts, max_skip,
+				wanted);
+		fclose(open_optimal_checkpoint(&probe, resume, &next));
+	}
+	opts.pool = parmin_pool_new(scan_threads);
+	/* A sweep only wants the statistics. */
+	if (!sweep) {
+		if (max_skip)
+			print_windowed_path(num, target, seed, &opts,
+					    max_skip);
+		else
+			print_proof_lengths(num, target, seed, &opts);
+	}
+	for (s = 0; s < ARRAY_SIZE(styles); s++) {
+		if (needs_whole[s])
+			printf("prooflen-%s: needs whole chain, skipping\n",
+			       styles[s].name);
+	}
+	if (sweep)
+		print_seed_stats(num, target, &opts, max_skip,
+				 wanted, seeds, njobs);
+	else
+		print_optimal_length(num, target, seed, &opts,
+				     nthreads, max_skip, wanted, checkpoint,
+				     checkpoint_every, resume);
+	parmin_pool_free(opts.pool);
 
 	return 0;
 }